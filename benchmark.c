@@ -0,0 +1,91 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "lib/dotplot.h"
+
+/*
+* Compare the cell-at-a-time alignment search with the bit-parallel one on a dotplot of
+* two random sequences that share some repeats
+*
+* Usage: plotbench [length]
+*/
+
+static int seqlen = 8000;
+static dotplot *dp;
+static clock_t startTime;
+
+static void
+start() {
+	startTime = clock();
+}
+
+static float
+stop() {
+	float duration = (float) (clock() - startTime) / CLOCKS_PER_SEC;
+	printf(": \x1b[32m%.4f\x1b[0ms", duration);
+	return duration;
+}
+
+static char *
+random_sequence(int length, const char *repeat) {
+	char *seq = malloc(length + 1);
+	int i = 0;
+	while (i < length) {
+		if (rand() % 8 == 0) { // drop in a copy of the shared repeat
+			const char *r = repeat;
+			while (*r && i < length) {
+				seq[i++] = *r++;
+			}
+		}
+		else {
+			seq[i++] = "ACGT"[rand() % 4];
+		}
+	}
+	seq[length] = '\0';
+	
+	return seq;
+}
+
+static void
+bm(int length) {
+	alignment_array *alignments;
+	float scalar, parallel;
+	
+	printf(" %10s n=%-3d", "scalar", length);
+	fflush(stdout);
+	start();
+	alignments = find_alignments_scalar(dp, length);
+	scalar = stop();
+	printf(" (%d alignments)\n", (int) alignments->count);
+	destroy_alignments(alignments);
+	
+	printf(" %10s n=%-3d", "bitrun", length);
+	fflush(stdout);
+	start();
+	alignments = find_alignments(dp, length);
+	parallel = stop();
+	printf(" (%d alignments) %.1fx\n", (int) alignments->count, parallel > 0 ? scalar / parallel : 0);
+	destroy_alignments(alignments);
+}
+
+int
+main(int argc, char **argv) {
+	if (argc > 1) {
+		seqlen = atoi(argv[1]);
+	}
+	
+	srand(1);
+	char *repeat = random_sequence(40, "");
+	char *seq1 = random_sequence(seqlen, repeat);
+	char *seq2 = random_sequence(seqlen, repeat);
+	dp = create_dotplot(seq1, seq2);
+	printf("\n %dx%d dotplot\n\n", seqlen, seqlen);
+	
+	bm(3);
+	bm(5);
+	bm(8);
+	bm(16);
+	bm(32);
+	puts("");
+	return 0;
+}
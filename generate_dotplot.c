@@ -1,4 +1,5 @@
 #include <stdio.h>
+#include <string.h>
 #include <unistd.h>
 #include "lib/dotplot.h"
 
@@ -11,7 +12,10 @@
 */
 
 void configure_colorchooser(color_chooser*);
-int write_imge(gdImagePtr, char*);
+suffix_index *load_index(char*, char*);
+void report_value_error(value_error*);
+int parse_reducer(char*, pixel_reducer*);
+char *read_sequence_file(char*);
 
 /*
 * Options:
@@ -20,20 +24,44 @@ int write_imge(gdImagePtr, char*);
 * 	p <filename>:	provide a file* for the x axis to use for an additional round of filterings (sorry)
 * 	q <filename>:	provide a file* for the y axis to use for an additional round of filterings (same here...)
 * 	n <int>:		filter to a minimum alignment length
+* 	t <int>:		number of threads to use for building and searching the dotplot
+* 	i <filename>:	suffix index for sequence1, created (or rebuilt) if it doesn't match sequence1
+* 	j:				pretty print the alignments JSON
+* 	b <filename>:	write the alignments to a binary alignment file instead of printing JSON
+* 	z:				compress the binary alignment file
+* 	c:				cache parsed filter values next to the value files (as <filename>.f32)
+* 	r <reducer>:	how the cells in one pixel are combined: any, max, mean or density (defaults to max
+* 					with filters and any without)
+* 	d <directory>:	also write a zoomable tile pyramid of the plot into directory, with the overview as the image
+* 	s <int>:		size of the tiles of the pyramid (256 by default)
+* 	f:				the sequences are FASTA files, given as file[:record[:start-end]]
+* 	T <int>:		compare the sequences in tiles of this many cells a side, so memory follows the tile size
 *
-*	* Files to be used as filters are multiline format with a decimal number between 0 and 1 (inclusive for both ends) which is used for an alignment multiplier
+*	* Files to be used as filters are multiline format with a decimal number between 0 and 1 (inclusive for both ends) which is used for an alignment multiplier.
+*	  Filter and sequence files may be gzip or bgzip compressed
 */
 int main(int argc, char **argv) {
 	/* Process options */
 	int nfilter = 5; // by default, filter to stretches of 5 base matches
 	int width = 2000;
 	int height = 2000;
+	int threads = 1;
 	char *xfilter = NULL;
 	char *yfilter = NULL;
 	char *xfilter2 = NULL;
 	char *yfilter2 = NULL;
+	char *indexfile = NULL;
+	json_style style = JSON_COMPACT;
+	char *binaryfile = NULL;
+	int compress = 0;
+	int cached = 0;
+	char *reducer = NULL;
+	char *tiledir = NULL;
+	int tile_size = 256;
+	int fasta = 0;
+	int tiles = 0;
 	int c;
-	while ((c = getopt(argc, argv, "x:y:p:q:n:w:h:")) != -1) {
+	while ((c = getopt(argc, argv, "x:y:p:q:n:w:h:t:i:jb:zcr:d:s:fT:")) != -1) {
 		switch (c) {
 			case 'x':
 				xfilter = optarg;
@@ -46,6 +74,7 @@ int main(int argc, char **argv) {
 				break;
 			case 'q':
 				yfilter2 = optarg;
+				break;
 			case 'n':
 				nfilter = atoi(optarg);
 				break;
@@ -55,6 +84,39 @@ int main(int argc, char **argv) {
 			case 'h':
 				height = atoi(optarg);
 				break;
+			case 't':
+				threads = atoi(optarg);
+				break;
+			case 'i':
+				indexfile = optarg;
+				break;
+			case 'j':
+				style = JSON_PRETTY;
+				break;
+			case 'b':
+				binaryfile = optarg;
+				break;
+			case 'z':
+				compress = 1;
+				break;
+			case 'c':
+				cached = 1;
+				break;
+			case 'r':
+				reducer = optarg;
+				break;
+			case 'd':
+				tiledir = optarg;
+				break;
+			case 's':
+				tile_size = atoi(optarg);
+				break;
+			case 'f':
+				fasta = 1;
+				break;
+			case 'T':
+				tiles = atoi(optarg);
+				break;
 			default:
 				return 1;
 		}
@@ -88,68 +150,152 @@ int main(int argc, char **argv) {
 		return 1;
 	}
 	
-	list_t *alignments;
-	dotplot *filtered;
-	dotplot *dp = create_dotplot(seq1, seq2);
-	if (nfilter > 1) {
-		alignments = find_alignments(dp, nfilter);
-		filtered = apply_alignments(dp, alignments);
+	if (tile_size < 2 || tile_size % 2 != 0) {
+		fprintf(stderr, "Tile size must be a positive even number\n");
+		return 1;
+	}
+	pixel_reducer pixels = xfilter != NULL && yfilter != NULL ? REDUCE_MAX : REDUCE_ANY;
+	if (reducer != NULL && !parse_reducer(reducer, &pixels)) {
+		fprintf(stderr, "Unknown reducer %s (expected any, max, mean or density)\n", reducer);
+		return 1;
+	}
+	
+	set_thread_count(threads); // compressed sequence files are inflated on these threads too
+	if (fasta) {
+		seq1 = read_sequence_file(seq1);
+		seq2 = read_sequence_file(seq2);
+		if (seq1 == NULL || seq2 == NULL) {
+			return 3;
+		}
+	}
+	
+	alignment_array *alignments;
+	dotplot *matches = NULL; // only built when there are no alignments to draw from
+	int plot_width = strlen(seq1);
+	int plot_height = strlen(seq2);
+	if (tiles > 0) { // found tile by tile while the plot is rendered
+		alignments = create_alignment_array();
+	}
+	else if (nfilter > 1) { // the unfiltered dotplot is never needed, so search the sequences directly
+		if (indexfile != NULL) {
+			suffix_index *index = load_index(indexfile, seq1);
+			alignments = find_alignments_indexed(index, seq2, nfilter);
+			destroy_suffix_index(index);
+		}
+		else if (nfilter >= 5) { // long enough for k-mer seeds to skip most of the matrix
+			alignments = find_alignments_kmer(seq1, seq2, nfilter);
+		}
+		else {
+			packed_sequence *packed1 = pack_sequence(seq1);
+			packed_sequence *packed2 = pack_sequence(seq2);
+			alignments = find_alignments_packed(packed1, packed2, nfilter);
+			destroy_packed_sequence(packed1);
+			destroy_packed_sequence(packed2);
+		}
 	}
 	else {
-		filtered = dp;
+		alignments = create_alignment_array(); // nothing to report
+		matches = create_dotplot(seq1, seq2);
 	}
 	
-	gdImagePtr image;
+	/* Every round of filters is scored in the same pass over the matches */
+	filter_pipeline *pipeline = create_filter_pipeline(plot_width, plot_height);
+	color_chooser *cc = NULL;
 	if (xfilter != NULL && yfilter != NULL) { // apply color filter
 		color default_color = {0, 0, 0};
-		color_chooser *cc = create_color_chooser(default_color);
+		cc = create_color_chooser(default_color);
 		configure_colorchooser(cc);
 		
-		filter *conservation_filter = create_filter_from_values(xfilter, yfilter);
+		value_error error;
+		filter *conservation_filter = load_filter(xfilter, yfilter, cached, &error);
 		if (conservation_filter == NULL) {
-			fprintf(stderr, "Can't open filter values file(s)\n");
+			report_value_error(&error);
 			return 3;
 		}
-		
-		dotplot *conserved = apply_filter(filtered, conservation_filter);
-		if (conserved == NULL) {
-			fprintf(stderr, "Unequal dimension size\n");
-			return 4;
-		}
+		add_filter_round(pipeline, conservation_filter);
 		
 		/* Second round of filters */
 		if (xfilter2 != NULL && yfilter2 != NULL) {
-			filter *round2_filter = create_filter_from_values(xfilter2, yfilter2);
+			filter *round2_filter = load_filter(xfilter2, yfilter2, cached, &error);
 			if (round2_filter == NULL) {
-				fprintf(stderr, "Can't open filter values file(s)\n");
+				report_value_error(&error);
 				return 3;
 			}
-			
-			conserved = apply_filter(conserved, round2_filter);
-			if (conserved == NULL) {
-				fprintf(stderr, "Unequal dimension size\n");
-				return 4;
-			}
+			add_filter_round(pipeline, round2_filter);
+		}
+	}
+	if (matches == NULL && tiles == 0) {
+		set_alignment_mask(pipeline, alignments);
+	}
+	alignment_sink sink = nfilter > 1 ? collect_alignment : NULL; // every match is drawn but none are reported
+	int did_write = 0;
+	if (tiledir != NULL) {
+		cell_renderer *renderer = create_tile_renderer(cc, pixels, plot_width, plot_height, tiledir, tile_size);
+		if (renderer == NULL) {
+			fprintf(stderr, "Can't create %s\n", tiledir);
+			return 2;
+		}
+		gdImagePtr image = tiles > 0 ? run_tiled_dotplot(seq1, seq2, nfilter, tiles, pipeline, renderer, sink, alignments) : run_filter_pipeline(pipeline, matches, renderer);
+		if (image == NULL) {
+			fprintf(stderr, "Can't write tiles to %s\n", tiledir);
+			return 2;
 		}
 		
-		image = render_dotplot_continuous(conserved, cc, width, height);
+		did_write = write_image(image, filename);
+		gdImageDestroy(image);
 	}
-	else {
-		image = render_dotplot(filtered, width, height);
+	else { // the image goes straight to the file one band of rows at a time
+		cell_renderer *renderer = create_png_renderer(cc, pixels, plot_width, plot_height, width, height, filename, &did_write);
+		if (renderer != NULL && tiles > 0) {
+			run_tiled_dotplot(seq1, seq2, nfilter, tiles, pipeline, renderer, sink, alignments);
+		}
+		else if (renderer != NULL) {
+			run_filter_pipeline(pipeline, matches, renderer);
+		}
 	}
-	
-	int did_write = write_image(image, filename);
-	gdImageDestroy(image);
 	if (!did_write) {
 		fprintf(stderr, "Can't create %s\n", filename);
 		return 2;
 	}
+	if (tiles > 0) { // tiles report alignments band by band
+		sort_runs(alignments->items, alignments->count, plot_width);
+	}
 	
-	print_alignments(alignments, seq1, seq2);
+	if (binaryfile != NULL) {
+		if (!write_alignments_binary(alignments, plot_width, plot_height, binaryfile, compress)) {
+			fprintf(stderr, "Can't create %s\n", binaryfile);
+			return 2;
+		}
+		return 0;
+	}
+	
+	json_writer *json = create_json_writer_fd(STDOUT_FILENO, style);
+	write_alignments(json, alignments, seq1);
+	destroy_json_writer(json);
 	//destroy_alignments(alignments);
 	return 0;
 }
 
+/*
+* Load the suffix index for seq1, building and saving it if the file is missing or was
+* built from another sequence
+*/
+suffix_index *load_index(char *filename, char *seq1) {
+	suffix_index *index = read_suffix_index(filename);
+	if (index != NULL && index->width == (int) strlen(seq1) && memcmp(index->text, seq1, index->width) == 0) {
+		return index;
+	}
+	if (index != NULL) {
+		destroy_suffix_index(index);
+	}
+	
+	index = create_suffix_index(seq1);
+	if (!write_suffix_index(index, filename)) {
+		fprintf(stderr, "Can't save index to %s\n", filename);
+	}
+	return index;
+}
+
 void configure_colorchooser(color_chooser *cc) {
 	color white = {255, 255, 255};
 	color light_grey = {166, 166, 166};
@@ -162,12 +308,78 @@ void configure_colorchooser(color_chooser *cc) {
 	add_color(cc, 0.75, 1, black);
 }
 
-int write_image(gdImagePtr image, char *filename) {
-	FILE *out = fopen(filename, "wb");
-	if (!out) {
+void report_value_error(value_error *error) {
+	if (error->line == 0) {
+		fprintf(stderr, "Can't open filter values file %s\n", error->file);
+	}
+	else {
+		fprintf(stderr, "%s:%d: malformed filter value\n", error->file, error->line);
+	}
+}
+
+int parse_reducer(char *name, pixel_reducer *reducer) {
+	if (strcmp(name, "any") == 0) {
+		*reducer = REDUCE_ANY;
+	}
+	else if (strcmp(name, "max") == 0) {
+		*reducer = REDUCE_MAX;
+	}
+	else if (strcmp(name, "mean") == 0) {
+		*reducer = REDUCE_MEAN;
+	}
+	else if (strcmp(name, "density") == 0) {
+		*reducer = REDUCE_DENSITY;
+	}
+	else {
 		return 0;
 	}
-	gdImagePng(image, out);
-	fclose(out);
+	
 	return 1;
 }
+
+/*
+* Read a sequence given as file[:record[:start-end]]. Without a record the first one is
+* used; ranges count from 1 and include both ends, as in samtools
+*/
+char *read_sequence_file(char *spec) {
+	char *path = strdup(spec);
+	char *name = NULL;
+	char *range = NULL;
+	char *colon;
+	fasta_file *file = open_fasta(path);
+	while (file == NULL && (colon = strrchr(path, ':')) != NULL) { // peel off the record and range
+		*colon = '\0';
+		range = name;
+		name = colon + 1;
+		file = open_fasta(path);
+	}
+	if (file == NULL) {
+		fprintf(stderr, "Can't open FASTA file %s\n", spec);
+		return NULL;
+	}
+	
+	fasta_record *record = name != NULL ? find_fasta_record(file, name) : file->count > 0 ? &file->records[0] : NULL;
+	if (record == NULL) {
+		fprintf(stderr, "No record %s in %s\n", name != NULL ? name : "at all", path);
+		return NULL;
+	}
+	
+	char *seq;
+	long start, end;
+	if (range == NULL) {
+		seq = read_fasta_record(file, record);
+	}
+	else if (sscanf(range, "%ld-%ld", &start, &end) == 2 && start >= 1 && end >= start) {
+		seq = read_fasta_range(file, record, start - 1, end - start + 1);
+	}
+	else {
+		fprintf(stderr, "Malformed range %s (expected start-end)\n", range);
+		return NULL;
+	}
+	if (seq == NULL) {
+		fprintf(stderr, "Range %s is outside of %s\n", range, record->name);
+	}
+	
+	close_fasta(file);
+	return seq;
+}
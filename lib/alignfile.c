@@ -0,0 +1,152 @@
+#include "alignfile.h"
+#include <stdlib.h>
+#include <string.h>
+
+/*
+* Reading side of the binary alignment format. Files are mapped rather than read so that
+* fixed records can be used in place: opening a file costs the same for a thousand
+* alignments as for a hundred million
+*/
+#ifdef __unix__
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/************** Private **************/
+int _read_varint(alignment_file *file, size_t *offset, uint64_t *value) {
+	uint64_t result = 0;
+	int shift;
+	for (shift = 0; shift < 64 && *offset < file->data_size; shift += 7) {
+		uint8_t byte = file->data[(*offset)++];
+		result |= (uint64_t) (byte & 0x7f) << shift;
+		if (!(byte & 0x80)) {
+			*value = result;
+			return 1;
+		}
+	}
+	
+	return 0; // truncated or overlong
+}
+
+int64_t _unzigzag(uint64_t value) {
+	return (int64_t) (value >> 1) ^ -(int64_t) (value & 1);
+}
+
+/*
+* Compare a record against a (strand, diagonal) key, ignoring x
+*/
+int _compare_diagonal(const alignment_record *record, direction strand, int64_t diagonal) {
+	if (record->strand != (int32_t) strand) {
+		return record->strand < (int32_t) strand ? -1 : 1;
+	}
+	
+	int64_t d = alignment_diagonal(record->x, record->y, record->strand);
+	return d < diagonal ? -1 : d > diagonal;
+}
+
+/************** Public  **************/
+alignment_file *open_alignment_file(char *filename) {
+	int fd = open(filename, O_RDONLY);
+	if (fd < 0) {
+		return NULL;
+	}
+	
+	struct stat st;
+	if (fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(alignment_file_header)) {
+		close(fd);
+		return NULL;
+	}
+	
+	void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd); // the mapping keeps the file open
+	if (map == MAP_FAILED) {
+		return NULL;
+	}
+	
+	const alignment_file_header *header = map;
+	size_t data_size = st.st_size - sizeof(alignment_file_header);
+	if (memcmp(header->magic, ALIGNMENT_FILE_MAGIC, 4) != 0 || header->version != ALIGNMENT_FILE_VERSION
+		|| (!(header->flags & ALIGNMENT_FILE_VARINT) && header->count != data_size / sizeof(alignment_record))
+		|| (!(header->flags & ALIGNMENT_FILE_VARINT) && data_size % sizeof(alignment_record) != 0)) {
+		munmap(map, st.st_size);
+		return NULL;
+	}
+	
+	alignment_file *file = malloc(sizeof(alignment_file));
+	file->width = header->width;
+	file->height = header->height;
+	file->flags = header->flags;
+	file->count = header->count;
+	file->data = (const uint8_t*) map + sizeof(alignment_file_header);
+	file->data_size = data_size;
+	file->records = header->flags & ALIGNMENT_FILE_VARINT ? NULL : (const alignment_record*) file->data;
+	file->map = map;
+	file->map_size = st.st_size;
+	
+	return file;
+}
+
+void close_alignment_file(alignment_file *file) {
+	munmap(file->map, file->map_size);
+	free(file);
+}
+
+int next_alignment(alignment_file *file, alignment_cursor *cursor, run *out) {
+	if (cursor->index >= file->count) {
+		return 0;
+	}
+	
+	if (file->records != NULL) {
+		const alignment_record *record = &file->records[cursor->index];
+		out->x = record->x;
+		out->y = record->y;
+		out->length = record->length;
+		out->dir = record->strand;
+	}
+	else {
+		/* Each record is the change in diagonal and in x since the previous one, then length << 1 | strand */
+		uint64_t delta_diagonal, delta_x, length;
+		if (!_read_varint(file, &cursor->offset, &delta_diagonal) || !_read_varint(file, &cursor->offset, &delta_x)
+			|| !_read_varint(file, &cursor->offset, &length)) {
+			return 0;
+		}
+		
+		cursor->diagonal += _unzigzag(delta_diagonal);
+		cursor->x += _unzigzag(delta_x);
+		out->x = cursor->x;
+		out->dir = length & 1 ? LR : UR;
+		out->y = out->dir == UR ? cursor->diagonal - cursor->x : cursor->x - cursor->diagonal;
+		out->length = length >> 1;
+	}
+	
+	cursor->index++;
+	return 1;
+}
+
+const alignment_record *find_diagonal(alignment_file *file, direction strand, int64_t diagonal, size_t *count) {
+	*count = 0;
+	if (file->records == NULL) {
+		return NULL;
+	}
+	
+	size_t low = 0, high = file->count;
+	while (low < high) { // first record at or after the diagonal
+		size_t mid = low + (high - low) / 2;
+		if (_compare_diagonal(&file->records[mid], strand, diagonal) < 0) {
+			low = mid + 1;
+		}
+		else {
+			high = mid;
+		}
+	}
+	
+	size_t end = low;
+	while (end < file->count && _compare_diagonal(&file->records[end], strand, diagonal) == 0) {
+		end++;
+	}
+	
+	*count = end - low;
+	return file->records + low;
+}
+#endif
@@ -0,0 +1,67 @@
+#ifndef DOTPLOT_ALIGNFILE_H
+#define DOTPLOT_ALIGNFILE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "run.h"
+
+/*
+* Binary alignment files. A 32 byte header is followed either by fixed 16 byte records or,
+* when ALIGNMENT_FILE_VARINT is set, by the same records delta/varint compressed. Records
+* are sorted by strand (UR first), then diagonal, then x. The diagonal of a run is x + y
+* for UR runs and x - y for LR runs. Integers are stored in the byte order of the writer
+*/
+#define ALIGNMENT_FILE_MAGIC "DPAL"
+#define ALIGNMENT_FILE_VERSION 1
+#define ALIGNMENT_FILE_VARINT 1 // flag: records are compressed
+
+typedef struct {
+	char magic[4];
+	uint32_t version;
+	uint32_t flags;
+	int32_t width;  // dimensions of the dotplot the alignments came from
+	int32_t height;
+	uint32_t reserved;
+	uint64_t count;
+} alignment_file_header;
+
+typedef struct {
+	int32_t x;
+	int32_t y;
+	int32_t length;
+	int32_t strand; // a direction: UR or LR
+} alignment_record;
+
+/* The diagonal a run lies on, as used for sorting */
+static inline int64_t alignment_diagonal(int x, int y, direction dir) {
+	return dir == UR ? (int64_t) x + y : (int64_t) x - y;
+}
+
+#ifdef __unix__
+typedef struct {
+	int width;
+	int height;
+	int flags;
+	size_t count;
+	const alignment_record *records; // NULL for compressed files
+	const uint8_t *data;             // compressed records
+	size_t data_size;
+	void *map;
+	size_t map_size;
+} alignment_file;
+
+/* Position of a sequential read through a file. Start from a zeroed cursor */
+typedef struct {
+	size_t index;
+	size_t offset;
+	int64_t diagonal;
+	int x;
+} alignment_cursor;
+
+alignment_file *open_alignment_file(char *filename); // returns NULL if the file is not an alignment file
+void close_alignment_file(alignment_file *file);
+int next_alignment(alignment_file *file, alignment_cursor *cursor, run *out); // returns 0 at the end or on corrupt data
+const alignment_record *find_diagonal(alignment_file *file, direction strand, int64_t diagonal, size_t *count); // fixed records only
+#endif
+
+#endif
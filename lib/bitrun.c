@@ -0,0 +1,212 @@
+#include "bitrun.h"
+#include "pool.h"
+#include <stdlib.h>
+#include <string.h>
+
+/*
+* Bit-parallel run detection. Let D_k mark the cells that start k consecutive matches along
+* a diagonal. D_1 is the match matrix and D_(a+b) row y is D_a row y AND D_b row y+a shifted
+* left by a columns, so D_n takes log2(n) passes of 64-cell word operations by doubling (plus
+* one overlapping pass when n is not a power of two). Runs start where D_n is set and the
+* previous cell on the diagonal is not, and their length is the number of D_n cells that
+* follow plus n-1. Anti-diagonals work the same way with row y-a
+*/
+
+/************** Private **************/
+typedef struct {
+	const uint64_t *src;
+	uint64_t *dst;
+	size_t stride;
+	int height;
+	int shift; // columns to shift by, which is also the row offset
+	int dy;    // 1 for diagonals, -1 for anti-diagonals
+	int tasks;
+} shift_job;
+
+typedef struct {
+	const uint64_t *marks; // D_n
+	size_t stride;
+	int width;
+	int height;
+	int length;
+	int dy;
+	int tasks;
+	run **found;
+	size_t *counts;
+} start_job;
+
+/*
+* dst = a & (b >> shift) over a row of `stride` words, where bit x of the result is bit x
+* of a and bit x + shift of b
+*/
+void _and_shifted(uint64_t *dst, const uint64_t *a, const uint64_t *b, size_t stride, int shift) {
+	size_t words = shift >> 6;
+	int bits = shift & 63;
+	size_t w;
+	for (w = 0; w < stride; w++) {
+		uint64_t shifted = 0;
+		if (w + words < stride) {
+			shifted = b[w + words] >> bits;
+			if (bits && w + words + 1 < stride) {
+				shifted |= b[w + words + 1] << (64 - bits);
+			}
+		}
+		dst[w] = a[w] & shifted;
+	}
+}
+
+void _shift_band(void *arg, int task) {
+	shift_job *job = (shift_job*) arg;
+	int start = (int) ((long long) job->height * task / job->tasks);
+	int end = (int) ((long long) job->height * (task + 1) / job->tasks);
+	int y;
+	for (y = start; y < end; y++) {
+		uint64_t *dst = job->dst + (size_t) y * job->stride;
+		int other = y + job->dy * job->shift;
+		if (other < 0 || other >= job->height) {
+			memset(dst, 0, job->stride * sizeof(uint64_t)); // the window runs off the matrix
+			continue;
+		}
+		_and_shifted(dst, job->src + (size_t) y * job->stride, job->src + (size_t) other * job->stride, job->stride, job->shift);
+	}
+}
+
+static inline int _marked(const start_job *job, int x, int y) {
+	return (job->marks[(size_t) y * job->stride + (x >> 6)] >> (x & 63)) & 1;
+}
+
+void _start_band(void *arg, int task) {
+	start_job *job = (start_job*) arg;
+	int start = (int) ((long long) job->height * task / job->tasks);
+	int end = (int) ((long long) job->height * (task + 1) / job->tasks);
+	run *found = NULL;
+	size_t count = 0, capacity = 0;
+	int y;
+	for (y = start; y < end; y++) {
+		const uint64_t *row = job->marks + (size_t) y * job->stride;
+		int previous_y = y - job->dy; // row holding the previous cell of each diagonal
+		const uint64_t *previous = previous_y >= 0 && previous_y < job->height ? job->marks + (size_t) previous_y * job->stride : NULL;
+		size_t w;
+		for (w = 0; w < job->stride; w++) {
+			uint64_t starts = row[w];
+			if (previous != NULL) { // drop cells whose previous cell (x-1) is also marked
+				uint64_t shifted = previous[w] << 1;
+				if (w > 0) {
+					shifted |= previous[w-1] >> 63;
+				}
+				starts &= ~shifted;
+			}
+			while (starts) {
+				int x = (int) (w * 64) + __builtin_ctzll(starts);
+				starts &= starts - 1;
+				
+				int t = 1;
+				while (x + t < job->width && y + t * job->dy >= 0 && y + t * job->dy < job->height && _marked(job, x + t, y + t * job->dy)) {
+					t++;
+				}
+				run r = {x, y, t + job->length - 1, job->dy > 0 ? LR : UR};
+				push_run(&found, &count, &capacity, r);
+			}
+		}
+	}
+	
+	job->found[task] = found;
+	job->counts[task] = count;
+}
+
+/*
+* Compute D_n in place of `marks`, using `scratch` as the second buffer. Returns whichever
+* of the two buffers holds the result
+*/
+uint64_t *_mark_starts(uint64_t *marks, uint64_t *scratch, size_t stride, int height, int length, int dy, int threads) {
+	shift_job job = {
+		.stride = stride,
+		.height = height,
+		.dy = dy,
+		.tasks = threads * 8 < height ? threads * 8 : height
+	};
+	if (job.tasks < 1) {
+		job.tasks = 1;
+	}
+	
+	int covered = 1;
+	while (covered * 2 <= length) { // doubling: D_2k from D_k
+		job.src = marks;
+		job.dst = scratch;
+		job.shift = covered;
+		pool_run(threads, job.tasks, _shift_band, &job);
+		scratch = marks;
+		marks = job.dst;
+		covered *= 2;
+	}
+	if (covered < length) { // D_n from two overlapping windows of D_covered
+		job.src = marks;
+		job.dst = scratch;
+		job.shift = length - covered;
+		pool_run(threads, job.tasks, _shift_band, &job);
+		marks = job.dst;
+	}
+	
+	return marks;
+}
+
+void _collect_starts(const uint64_t *marks, size_t stride, int width, int height, int length, int dy, int threads, run **runs, size_t *count, size_t *capacity) {
+	start_job job = {
+		.marks = marks,
+		.stride = stride,
+		.width = width,
+		.height = height,
+		.length = length,
+		.dy = dy,
+		.tasks = threads * 8 < height ? threads * 8 : height
+	};
+	if (job.tasks < 1) {
+		job.tasks = 1;
+	}
+	run *found[job.tasks];
+	size_t counts[job.tasks];
+	job.found = found;
+	job.counts = counts;
+	pool_run(threads, job.tasks, _start_band, &job);
+	
+	int i;
+	size_t r;
+	for (i = 0; i < job.tasks; i++) {
+		for (r = 0; r < counts[i]; r++) {
+			push_run(runs, count, capacity, found[i][r]);
+		}
+		free(found[i]);
+	}
+}
+
+/************** Public  **************/
+run *bitrun_find_runs(const uint64_t *bits, size_t stride, int width, int height, int length, int threads, size_t *count) {
+	size_t words = stride * (size_t) height;
+	size_t capacity = 0;
+	run *runs = NULL;
+	int dy;
+	
+	*count = 0;
+	if (length < 1) {
+		length = 1;
+	}
+	if (words == 0) {
+		return malloc(sizeof(run));
+	}
+	
+	uint64_t *marks = malloc(words * sizeof(uint64_t));
+	uint64_t *scratch = malloc(words * sizeof(uint64_t));
+	for (dy = -1; dy <= 1; dy += 2) { // anti-diagonals first, like find_alignments
+		memcpy(marks, bits, words * sizeof(uint64_t));
+		uint64_t *starts = _mark_starts(marks, scratch, stride, height, length, dy, threads);
+		_collect_starts(starts, stride, width, height, length, dy, threads, &runs, count, &capacity);
+	}
+	free(marks);
+	free(scratch);
+	
+	if (runs == NULL) {
+		runs = malloc(sizeof(run));
+	}
+	sort_runs(runs, *count, width);
+	return runs;
+}
@@ -0,0 +1,14 @@
+#ifndef DOTPLOT_BITRUN_H
+#define DOTPLOT_BITRUN_H
+
+#include <stdint.h>
+#include "run.h"
+
+/*
+* Find every run of at least `length` set cells along the diagonals and anti-diagonals of a
+* bit-packed matrix (row-major, `stride` words per row). Returns the runs in find_alignments
+* order
+*/
+run *bitrun_find_runs(const uint64_t *bits, size_t stride, int width, int height, int length, int threads, size_t *count);
+
+#endif
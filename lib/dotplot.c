@@ -1,8 +1,20 @@
 #include "dotplot.h"
+#include "alignfile.h"
+#include "json.h"
+#include "bitrun.h"
+#include "fasta.h"
+#include "gzip.h"
+#include "kernel.h"
+#include "kmer.h"
+#include "packed.h"
+#include "pngstream.h"
+#include "pool.h"
+#include "values.h"
 #include <string.h>
 #include <stdlib.h>
 
 #ifdef __unix__
+	#include <limits.h>
 	#include <stdio.h>
 	#include <sys/stat.h>
 #endif
@@ -19,11 +31,6 @@
 
 /************** Private **************/
 // Enums/Structs
-typedef enum {
-	UL, // upper left
-	UR  // upper right
-} direction;
-
 typedef struct {
 	float start;
 	float end;
@@ -31,609 +38,2058 @@ typedef struct {
 } color_range;
 
 typedef struct {
-	float **vals;
+	dotplot *dp;
+	char *seq1;
+	char *seq2;
+	match_kernel kernel;
+	int tasks;
+} row_job;
+
+/*
+* Where the diagonal scans read matches from: a materialized dotplot, packed sequences,
+* or the two sequence strings themselves
+*/
+typedef struct {
+	dotplot *dp;
+	char *seq1;
+	char *seq2;
+	packed_sequence *packed1;
+	packed_sequence *reversed1; // packed1 reversed, for anti-diagonals
+	packed_sequence *packed2;
 	int width;
 	int height;
-} array2d;
+} match_source;
 
 typedef struct {
-	int x;
-	int y;
-} point2d;
+	dotplot *dp;
+	packed_sequence *seq1;
+	packed_sequence *seq2;
+	int tasks;
+} packed_row_job;
 
 typedef struct {
-	point2d *points;
-	int length;
-} alignment;
+	match_source *source;
+	alignment_array **found; // one array per task, merged in task order
+	int dx;
+	int matchLength;
+	int tasks;
+} diagonal_job;
 
-// Definitions
-alignment *alignment_create(point2d *points, int length) {
-	int i;
-	alignment *align = malloc(sizeof(alignment));
-	point2d *pts = malloc(sizeof(point2d) * length);
-	for (i = 0; i < length; i++) {
-		pts[i] = points[i];
-	}
-	align->points = pts;
-	align->length = length;
-	
-	return align;
-}
+typedef struct {
+	dotplot *filtered;
+	filter *f;
+	int max_x;
+	int max_y;
+	int tasks;
+} filter_job;
 
-void alignment_destroy(alignment *a) {
-	free(a->points);
-	free(a);
-}
+/*
+* State of the gd renderer behind render_dotplot_continuous
+*/
+typedef struct {
+	gdImagePtr image;
+	color_table *table;
+	int *colors; // gd color of each palette entry
+	region_index *regions; // NULL when matches aren't colored by region
+	int *region_colors;
+	double cell_width;
+	double cell_height;
+	double render_width;
+	double render_height;
+} continuous_renderer;
 
-int _color_index(color_chooser *cc, float value) {
-	int i = 0;
-	list_iterator_t *li = list_iterator_new(cc->ranges, LIST_HEAD);
-	list_node_t *cnode = NULL;
-	color_range *cr = NULL;
-	while ((cnode = list_iterator_next(li)) != NULL) {
-		cr = cnode->val;
-		if (cr->start <= value && cr->end >= value) {
-			return i;
-		}
-		
-		i++;
-	}
-	
-	list_iterator_destroy(li);
-	return i; // should be == length
-}
+/*
+* State of a pixel-binning renderer. Cells only update the buffers of the pixel they fall in;
+* the image is built once all cells are in
+*/
+typedef struct {
+	color_table *table; // NULL for a gray ramp from white (0) to black (1)
+	pixel_reducer reducer;
+	int plot_width;
+	int plot_height;
+	int width;
+	int height;
+	double cell_width;
+	double cell_height;
+	float *values;    // any, max or sum of the cells of each pixel
+	uint32_t *counts; // cells in each pixel, for the mean and the density
+} binned_renderer;
 
-array2d *_allocate_array2d(int width, int height) {
-	int i;
-	float **cells;
-	cells = (float**) malloc(width * sizeof(float*));
-	for (i = 0; i < width; i++) {
-		cells[i] = (float*) malloc(height * sizeof(float));
-	}
-	
-	array2d *array = (array2d *) malloc(sizeof(array2d));
-	array->vals = cells;
-	array->width = width;
-	array->height = height;
-	return array;
-}
+/*
+* State of a streaming PNG renderer: a binned renderer that only holds one band of pixel
+* rows. Cells come in row order, so once a cell lands below the band every row of the band
+* is final and goes out to the encoder
+*/
+#define PNG_BAND_ROWS 64
+#define PALETTE_SIZE (COLOR_CHOOSER_MAX_RANGES + 2) // background, ranges and the default color; pixels are one byte
 
-array2d *_create_avg_array(int width, int height, float *vals1, float *vals2) {
-	int x, y;
-	
-	array2d *array = _allocate_array2d(width, height);
-	float **vals = array->vals;
-	for (y = 0; y < height; y++) {
-		for (x = 0; x < width; x++) {
-			float val = (vals1[x] + vals2[y]) / 2.0;
-			vals[x][y] = val;
-		}
-	}
-	
-	return array;
-}
+typedef struct {
+	color_table *table; // NULL for a gray ramp
+	pixel_reducer reducer;
+	int plot_width;
+	int plot_height;
+	int width;
+	int height;
+	double cell_width;
+	double cell_height;
+	int band; // first pixel row of the band
+	float *values;     // PNG_BAND_ROWS rows of pixels, like the binned renderer's buffers
+	uint32_t *counts;
+	uint32_t *columns; // cells per pixel along each axis, for the density
+	uint32_t *rows;
+	uint8_t touched[PNG_BAND_ROWS]; // rows of the band a cell fell in
+	uint8_t *line;     // palette entries of the row being encoded
+	png_stream *png;
+	int *written;
+} png_renderer;
+
+#ifdef __unix__
+/*
+* Pixel buffers of one tile of a pyramid, laid out like the binned renderer's
+*/
+typedef struct {
+	float *values;
+	uint32_t *counts;
+} tile;
+
+/*
+* One level of a tile pyramid. Only the row of tiles being filled is kept, and only its
+* tiles that something fell in
+*/
+typedef struct {
+	int width; // in pixels
+	int height;
+	int columns; // in tiles
+	int rows;
+	int row; // row of tiles being filled
+	tile **tiles; // one per column, NULL while empty
+	int *filled; // columns of the tiles that exist
+	int filled_count;
+} tile_level;
+
+/*
+* State of a tile pyramid renderer. The last level has one pixel per cell and every level
+* above it halves the one below, down to a single pixel at level 0
+*/
+typedef struct {
+	char *directory;
+	color_table *table; // NULL for a gray ramp
+	pixel_reducer reducer;
+	int plot_width;
+	int plot_height;
+	int tile_size;
+	int levels;
+	int overview; // largest level that fits in one tile
+	tile_level *level;
+	FILE *manifest_file;
+	json_writer *manifest;
+	gdImagePtr image; // the overview tile
+	int failed;
+} tile_renderer;
+#endif
+
+typedef struct {
+	sparse_dotplot *filtered;
+	filter *f;
+	int tasks;
+} sparse_filter_job;
+
+// Globals
+static int thread_count = 1; // worker threads used for the O(n*m) loops
 
+// Definitions
+/*
+* Allocate a dotplot with every cell cleared. The match matrix is a single block so the
+* whole plot costs one bit per cell instead of one float per cell
+*/
 dotplot *_dotplot_allocate(int width, int height) {
-	int i;
-	float **cells;
-	cells = (float**) malloc(width * sizeof(float*));
-	for (i = 0; i < width; i++) {
-		cells[i] = (float*) malloc(height * sizeof(float));
-	}
-	
 	dotplot *dp = (dotplot *) malloc(sizeof(dotplot));
 	dp->width = width;
 	dp->height = height;
-	dp->cells = cells;
+	dp->stride = ((size_t) width + 63) / 64;
+	dp->bits = (uint64_t*) calloc(dp->stride * (size_t) height, sizeof(uint64_t));
+	dp->scores = NULL;
 	dp->regions = list_new();
+	dp->regions->free = free; // add_region stores copies
 	return dp;
 }
 
-region *_find_region_for(dotplot *dp, int x, int y) {
-	list_iterator_t *iter = list_iterator_new(dp->regions, LIST_HEAD);
-	
-	region *curr = NULL;
-	region *found = NULL;
-	while ((curr = (region*) list_iterator_next(iter)) != NULL) {
-		if (curr->axis == X) {
-			if (x >= curr->start && x <= (curr->start + curr->length)) {
-				found = curr;
-				break;
-			}
-		}
-		if (curr->axis == Y) {
-			if (y >= curr->start && y <= (curr->start + curr->length)) {
-				found = curr;
-				break;
-			}
-		}
+static inline int _is_set(dotplot *dp, int x, int y) {
+	return (dp->bits[(size_t) y * dp->stride + (x >> 6)] >> (x & 63)) & 1;
+}
+
+static inline void _set_bit(dotplot *dp, int x, int y) {
+	dp->bits[(size_t) y * dp->stride + (x >> 6)] |= (uint64_t) 1 << (x & 63);
+}
+
+/*
+* A cell takes part in an alignment if it matched and, when filtered, kept a positive score
+*/
+static inline int _is_on(dotplot *dp, int x, int y) {
+	if (!_is_set(dp, x, y)) {
+		return 0;
 	}
 	
-	list_iterator_destroy(iter);
-	return found; // will be NULL if not found
+	return dp->scores == NULL || dp->scores[(size_t) y * dp->width + x] > 0;
 }
 
 /*
-* Return a stretch of points representing an alignment to filter to
+* Value of a filter at a cell. Separable filters average the values of the row and column
 */
-alignment *_set_match(dotplot *dp, int x, int y, direction dir, int length) {
-	int match_index = 0;
-	int alignment_length = length;
-	point2d matches[length];
+static inline float _filter_value(filter *f, int x, int y) {
+	if (f->cells != NULL) {
+		return f->cells[x][y];
+	}
 	
-	switch(dir) {
-		case UL: // build from (x, y) diagonally to upper left
-			while (length > 0) {
-				point2d match = {
-					.x = --x,
-					.y = --y
-				};
-				matches[match_index++] = match;
-				length--;
-			}
-			break;
-		case UR: // build from (x, y) diagonally to upper right
-			length++;
-			while (length > 0) {
-				point2d match = {
-					.x = x++,
-					.y = y--
-				};
-				matches[match_index++] = match;
-				length--;
-			}
-			break;
-		default:
-			break;
+	float sum = f->x_values[x] + f->y_values[y];
+	return sum / 2.0;
+}
+
+static inline int _is_match(match_source *source, int x, int y) {
+	if (source->dp != NULL) {
+		return _is_on(source->dp, x, y);
 	}
 	
-	return alignment_create(matches, match_index);
+	return source->seq1[x] == source->seq2[y];
 }
 
 /*
-* Get left diagonal coordinates for alignments
+* Get the score plane, creating it on first use. Every existing match starts at 1.0
 */
-list_t *_find_left_diagonals(dotplot *dp, int matchLength) {
-	int stretch, x;
-	list_t *alignments = list_new(); // each entry in this list is an alignment struct
-	
-	x = dp->width-1;
-	while (x >= 0) { // upper right (rows)
-		stretch = 0;
-		int y = 0;
-		int x2 = x;
-		while (x2 >= 0) { // searching from top right for left,down diagonals
-			if (dp->cells[x2][y] > 0) { // alignment found
-				stretch++;
-			}
-			else {
-				if (stretch >= matchLength) { // no match, but nonmatch terminated a long enough stretch for inclusion
-					list_rpush(alignments, list_node_new(_set_match(dp, x2+1, y-1, UR, stretch)));
-				}
-				stretch = 0;
-			}
-			
-			x2--;
-			y++;
-			if (y > dp->height) {
-				break;
-			}
-		}
-		
-		if (stretch >= matchLength) {
-			list_rpush(alignments, list_node_new(_set_match(dp, x2+1, y-1, UR, stretch)));
+float *_dotplot_scores(dotplot *dp) {
+	if (dp->scores == NULL) {
+		size_t i;
+		size_t size = (size_t) dp->width * dp->height;
+		dp->scores = (float*) malloc(size * sizeof(float));
+		for (i = 0; i < size; i++) {
+			dp->scores[i] = 1.0;
 		}
-		x--;
 	}
 	
-	int y = 1;
-	while (y < dp->height) { // lower right (columns)
-		stretch = 0;
-		int x = dp->width-1;
-		int y2 = y;
-		while (y2 < dp->height && x > 0) {
-			if (dp->cells[x][y2] > 0) {
-				stretch++;
-			}
-			else {
-				if (stretch >= matchLength) {
-					list_rpush(alignments, list_node_new(_set_match(dp, x+1, y2-1, UR, stretch)));
-				}
-				stretch = 0;
-			}
-			
-			y2++;
-			if (y2 > dp->height) break;
-			x--;
+	return dp->scores;
+}
+
+int _compare_ints(const void *a, const void *b) {
+	int i1 = *(const int*) a, i2 = *(const int*) b;
+	return (i1 > i2) - (i1 < i2);
+}
+
+/*
+* Index of the last value in sorted that is <= value, -1 if there is none
+*/
+static inline int _last_at_most(int *sorted, int count, int value) {
+	int low = 0;
+	int high = count;
+	while (low < high) {
+		int mid = low + (high - low) / 2;
+		if (sorted[mid] <= value) {
+			low = mid + 1;
 		}
-		
-		if (stretch >= matchLength) {
-			list_rpush(alignments, list_node_new(_set_match(dp, x+1, y2-1, UR, stretch)));
+		else {
+			high = mid;
 		}
-		y++;
-		if (y > dp->height) break;
 	}
 	
-	return alignments;
+	return low - 1;
 }
 
 /*
-* Get right diagonal coordinates for alignments
+* Cut one axis at every region boundary and give each segment the first region covering it.
+* Neighbouring segments that end up with the same region are merged
 */
-list_t *_find_right_diagonals(dotplot *dp, int matchLength) {
-	int stretch, x;
-	list_t *alignments = list_new();
-	
-	x = 0;
-	while (x < dp->width) { // upper right (rows)
-		stretch = 0;
-		int y = 0;
-		int x2 = x;
-		while (x2 < dp->width) {
-			if (dp->cells[x2][y] > 0) {
-				stretch++;
-			}
-			else {
-				if (stretch >= matchLength) {
-					list_rpush(alignments, list_node_new(_set_match(dp, x2-1, y-1, UL, stretch)));
-				}
-				stretch = 0;
-			}
-			
-			x2++;
-			y++;
-			if (y > dp->height) break;
+void _compile_axis(region_axis *axis, region *regions, int count, axis_t which) {
+	int *bounds = malloc(2 * (count + 1) * sizeof(int));
+	int n = 0;
+	int i, j;
+	for (i = 0; i < count; i++) {
+		if (regions[i].axis == which && regions[i].length > 0) {
+			bounds[n++] = regions[i].start;
+			bounds[n++] = regions[i].start + regions[i].length;
 		}
-		
-		if (stretch >= matchLength) {
-			list_rpush(alignments, list_node_new(_set_match(dp, x2-1, y-1, UL, stretch)));
+	}
+	qsort(bounds, n, sizeof(int), _compare_ints);
+	int unique = 0;
+	for (i = 0; i < n; i++) {
+		if (unique == 0 || bounds[i] != bounds[unique-1]) {
+			bounds[unique++] = bounds[i];
 		}
-		x++;
-		if(x > dp->width) break;
 	}
 	
-	int y = 1;
-	while (y < dp->height) { // lower left (columns)
-		stretch = 0;
-		int x = 0;
-		int y2 = y;
-		while (y2 < dp->height && x < dp->width) {
-			if (dp->cells[x][y2] > 0) {
-				stretch++;
-			}
-			else {
-				if (stretch >= matchLength) {
-					list_rpush(alignments, list_node_new(_set_match(dp, x-1, y2-1, UL, stretch)));
-				}
-				stretch = 0;
-			}
-			
-			y2++;
-			x++;
-			if (x > dp->width) break;
+	int *owners = malloc((unique + 1) * sizeof(int));
+	for (i = 0; i < unique; i++) {
+		owners[i] = -1;
+	}
+	for (i = 0; i < count; i++) {
+		if (regions[i].axis != which || regions[i].length <= 0) {
+			continue;
 		}
 		
-		if (stretch >= matchLength) {
-			list_rpush(alignments, list_node_new(_set_match(dp, x-1, y2-1, UL, stretch)));
+		int end = regions[i].start + regions[i].length;
+		for (j = _last_at_most(bounds, unique, regions[i].start); j < unique && bounds[j] < end; j++) {
+			if (owners[j] < 0) { // an earlier region wins
+				owners[j] = i;
+			}
 		}
-		y++;
-		if (y > dp->height) break;
 	}
 	
-	return alignments;
+	axis->count = 0;
+	axis->starts = bounds;
+	axis->regions = owners;
+	for (i = 0; i < unique; i++) {
+		if (axis->count == 0 || owners[i] != owners[axis->count-1]) {
+			bounds[axis->count] = bounds[i];
+			owners[axis->count] = owners[i];
+			axis->count++;
+		}
+	}
 }
 
-#ifdef __unix__
-void _strip_header_and_newlines(char *seq) {
-	char *p2 = seq;
-    while(*seq != '\0') {
-    	if(*seq != '\t' && *seq != '\n') {
-    		*p2++ = *seq++;
-    	} else {
-    		++seq;
-    	}
-    }
-    *p2 = '\0';
-}
-
-//TODO: currently only supports pure-sequence fasta (no header line)
-char *_read_fasta(char *file) {
-	FILE *fp;
-	if ((fp = fopen(file, "r")) == NULL) {
-		return NULL;
-	}
-	
-	struct stat file_stat;
-	if (stat(file, &file_stat) != 0) {
-		return NULL;
-	}
-	
-	int size = (int) file_stat.st_size;
-	char *seq = malloc(sizeof(char) * size);
-	
-	fread(seq, sizeof(char), size-1, fp);
-	_strip_header_and_newlines(seq);
-	
-	return seq;
+static inline int _axis_region(region_axis *axis, int position) {
+	int segment = _last_at_most(axis->starts, axis->count, position);
+	return segment < 0 ? -1 : axis->regions[segment];
 }
-#endif
 
-filter *_filter_allocate(int width, int height) {
+/*
+* gd color of each region, blue for regions without a color of their own
+*/
+int *_region_colors(gdImagePtr image, region_index *index) {
+	int *colors = malloc(index->count * sizeof(int));
 	int i;
-	float **cells;
-	cells = (float**) malloc(width * sizeof(float*));
-	for (i = 0; i < width; i++) {
-		cells[i] = (float*) malloc(height * sizeof(float));
+	for (i = 0; i < index->count; i++) {
+		color *c = index->regions[i].color;
+		colors[i] = c != NULL ? gdImageColorResolve(image, c->red, c->green, c->blue) : gdImageColorResolve(image, 47, 47, 203);
 	}
 	
-	filter *f = (filter *) malloc(sizeof(filter));
-	f->width = width;
-	f->height = height;
-	f->cells = cells;
-	
-	return f;
+	return colors;
 }
 
-float *_read_val_list(char *file, int *size) {
-	FILE *fp;
-	if ((fp = fopen(file, "r")) == NULL) {
-		return NULL;
+/*
+* Number of bands to split `items` rows or diagonals into. Using several bands per thread
+* keeps threads busy when bands take uneven time (diagonals differ in length)
+*/
+int _task_count(int items) {
+	int tasks = thread_count * 8;
+	if (tasks > items) {
+		tasks = items;
 	}
 	
-	list_t *vals = list_new();
-	char *line = NULL;
-	size_t len = 0;
-	ssize_t read;
-	while ((read = getline(&line, &len, fp)) != -1) {
-		line[strlen(line)-1] = '\0'; // remove newline
-		char *linecpy = malloc(sizeof(char) * strlen(line));
-		
-		list_rpush(vals, list_node_new(strcpy(linecpy, line)));
+	return tasks > 0 ? tasks : 1;
+}
+
+/*
+* Get the [start, end) range of items handled by a task
+*/
+void _band(int items, int tasks, int task, int *start, int *end) {
+	*start = (int) ((long long) items * task / tasks);
+	*end = (int) ((long long) items * (task + 1) / tasks);
+}
+
+/*
+* Same as _task_count and _band for counts past INT_MAX, such as the cells of a sparse dotplot
+*/
+int _task_count_sized(size_t items) {
+	size_t tasks = (size_t) thread_count * 8;
+	if (tasks > items) {
+		tasks = items;
 	}
 	
-	float *rval = (float*) malloc(sizeof(float) * vals->len);
-	*size = vals->len;
-	list_iterator_t *lit = list_iterator_new(vals, LIST_HEAD);
-	list_node_t *cnode = NULL;
-	int index = 0;
-	while ((cnode = list_iterator_next(lit)) != NULL) {
-		float val = atof((char*) cnode->val);
-		rval[index++] = val;
+	return tasks > 0 ? (int) tasks : 1;
+}
+
+void _band_sized(size_t items, int tasks, int task, size_t *start, size_t *end) { // split so items * task can't overflow
+	*start = items / tasks * task + items % tasks * task / tasks;
+	*end = items / tasks * (task + 1) + items % tasks * (task + 1) / tasks;
+}
+
+/*
+* Add a run of matches starting at (x, y). Alignments are always oriented in the direction
+* of the first sequence, so x grows along the run
+*/
+void _push_alignment(alignment_array *alignments, int x, int y, direction dir, int length) {
+	alignment align = {x, y, length, dir};
+	push_run(&alignments->items, &alignments->count, &alignments->capacity, align);
+}
+
+/*
+* Move every alignment of `other` to the end of `alignments` and free `other`
+*/
+void _append_alignments(alignment_array *alignments, alignment_array *other) {
+	if (alignments->count == 0) { // take over the storage
+		free(alignments->items);
+		*alignments = *other;
+		free(other);
+		return;
 	}
-	if (line) {
-		free(line);
+	if (other->count == 0) {
+		destroy_alignments(other);
+		return;
+	}
+	if (alignments->count + other->count > alignments->capacity) {
+		alignments->capacity = alignments->count + other->count;
+		alignments->items = realloc(alignments->items, alignments->capacity * sizeof(alignment));
 	}
 	
-	list_destroy(vals);
-	return rval; // make sure to free this once you're done
+	memcpy(alignments->items + alignments->count, other->items, other->count * sizeof(alignment));
+	alignments->count += other->count;
+	destroy_alignments(other);
 }
 
-alignment *_reverse_alignment(alignment *a) {
-	point2d *points = a->points;
-	point2d reversed[a->length];
-	
-	int i;
-	int j = 0;
-	for (i = a->length; i > 0; i--) {
-		reversed[j++] = points[i-1];
+void _match_rows(void *arg, int task) {
+	row_job *job = (row_job*) arg;
+	dotplot *dp = job->dp;
+	int start, end, y;
+	_band(dp->height, job->tasks, task, &start, &end);
+	for (y = start; y < end; y++) {
+		job->kernel(job->seq1, dp->width, job->seq2[y], dp->bits + (size_t) y * dp->stride);
 	}
-	
-	return alignment_create(reversed, a->length);
 }
 
-/************** Public  **************/
-dotplot *create_dotplot(char *seq1, char *seq2) {
-	dotplot *dp = _dotplot_allocate(strlen(seq1), strlen(seq2));
-	int y, x;
-	for (y = 0; y < dp->height; y++) {
-		for (x = 0; x < dp->width; x++) {
-			if (seq1[x] == seq2[y]) {
-				dp->cells[x][y] = 1.0;
-			}
-			else {
-				dp->cells[x][y] = 0.0;
+void _match_packed_rows(void *arg, int task) {
+	packed_row_job *job = (packed_row_job*) arg;
+	dotplot *dp = job->dp;
+	int start, end, y;
+	_band(dp->height, job->tasks, task, &start, &end);
+	for (y = start; y < end; y++) {
+		packed_match_row(job->seq1, job->seq2, y, dp->bits + (size_t) y * dp->stride);
+	}
+}
+
+/*
+* Score the matches in a band of rows, visiting only the set bits. Like set_value, cells
+* already filtered down to 0 keep their score
+*/
+void _filter_rows(void *arg, int task) {
+	filter_job *job = (filter_job*) arg;
+	dotplot *dp = job->filtered;
+	float epsilon = 0.00001;
+	int start, end, y;
+	size_t word;
+	_band(job->max_y, job->tasks, task, &start, &end);
+	for (y = start; y < end; y++) {
+		uint64_t *row = dp->bits + (size_t) y * dp->stride;
+		float *scores = dp->scores + (size_t) y * dp->width;
+		for (word = 0; word * 64 < (size_t) job->max_x; word++) {
+			uint64_t bits = row[word];
+			while (bits) {
+				int x = (int) (word * 64) + __builtin_ctzll(bits);
+				bits &= bits - 1;
+				if (x >= job->max_x) {
+					break;
+				}
+				if (scores[x] < epsilon && scores[x] > -epsilon) {
+					continue;
+				}
+				
+				scores[x] = _filter_value(job->f, x, y);
 			}
 		}
 	}
+}
+
+/*
+* Fill in the palette rendered pixels are drawn from, as RGB triples, and return its size
+* (at most PALETTE_SIZE). Entry 0 is white and doubles as the background. With a color table
+* the ranges follow, then its default color; without one the palette is 256 grays from white
+* to black
+*/
+int _palette(color_table *table, uint8_t *rgb) {
+	int colors = table != NULL ? table->count + 2 : PALETTE_SIZE;
+	int i;
+	for (i = 0; i < colors; i++) {
+		color c = {255 - i, 255 - i, 255 - i};
+		if (table != NULL && i > 0) {
+			c = table->colors[i-1];
+		}
+		rgb[3*i] = c.red;
+		rgb[3*i+1] = c.green;
+		rgb[3*i+2] = c.blue;
+	}
 	
-	return dp;
+	return colors;
 }
 
-#ifdef __unix__
-dotplot *create_dotplot_from_fasta(char *file1, char *file2) {
-	char *seq1 = _read_fasta(file1);
-	char *seq2 = _read_fasta(file2);
-	if (seq1 == NULL || seq2 == NULL) {
-		return NULL;
+/*
+* Allocate the palette in a gd image. Returns the gd color of each palette entry
+*/
+int *_allocate_colors(gdImagePtr image, color_table *table) {
+	uint8_t rgb[3 * PALETTE_SIZE];
+	int count = _palette(table, rgb);
+	int *colors = malloc(count * sizeof(int));
+	int i;
+	for (i = 0; i < count; i++) {
+		colors[i] = gdImageColorAllocate(image, rgb[3*i], rgb[3*i+1], rgb[3*i+2]);
 	}
 	
-	dotplot *dp = create_dotplot(seq1, seq2);
+	return colors;
+}
+
+/*
+* Palette entry of a value
+*/
+static inline int _palette_index(color_table *table, float value) {
+	if (table != NULL) {
+		return 1 + color_table_index(table, value);
+	}
 	
-	free(seq1);
-	free(seq2);
-	return dp;
+	return value >= 1 ? 255 : (int) (value * 255 + 0.5);
 }
-#endif
 
-dotplot *zero_dotplot(dotplot *dp) {
-	dotplot *zeroed = _dotplot_allocate(dp->width, dp->height);
-	int y, x;
-	for (y = 0; y < zeroed->height; y++) {
-		for (x = 0; x < zeroed->width; x++) {
-			zeroed->cells[x][y] = 0.0;
+static inline int _pixel_color(color_table *table, int *colors, float value) {
+	return colors[_palette_index(table, value)];
+}
+
+void _continuous_cell(cell_renderer *renderer, int x, int y, float value) {
+	continuous_renderer *state = renderer->state;
+	double pixel_x = x * state->cell_width;
+	double pixel_y = y * state->cell_height;
+	int color = _pixel_color(state->table, state->colors, value);
+	if (state->regions != NULL) {
+		int r = region_at(state->regions, x, y);
+		if (r >= 0) {
+			color = state->region_colors[r];
 		}
 	}
 	
-	return zeroed;
+	gdImageFilledRectangle(state->image, pixel_x, pixel_y, pixel_x + state->render_width, pixel_y + state->render_height, color);
 }
 
-dotplot *clone_dotplot(dotplot *dp) {
-	dotplot *clone = _dotplot_allocate(dp->width, dp->height);
-	float **cells = dp->cells;
-	float **cloneCells = clone->cells;
-	
-	int y, x;
-	for (y = 0; y < dp->height; y++) {
-		for (x = 0; x < dp->width; x++) {
-			cloneCells[x][y] = cells[x][y];
+gdImagePtr _continuous_finish(cell_renderer *renderer) {
+	continuous_renderer *state = renderer->state;
+	gdImagePtr image = state->image;
+	destroy_color_table(state->table);
+	free(state->colors);
+	free(state->region_colors);
+	free(state);
+	free(renderer);
+	return image;
+}
+
+/*
+* Fold a cell, or a whole pixel of `count` cells, into the buffers of a pixel
+*/
+static inline void _accumulate(pixel_reducer reducer, float *values, uint32_t *counts, size_t pixel, float value, uint32_t count) {
+	switch (reducer) {
+		case REDUCE_ANY:
+			values[pixel] = 1.0;
+			break;
+		case REDUCE_MAX:
+			if (value > values[pixel]) {
+				values[pixel] = value;
+			}
+			break;
+		case REDUCE_MEAN:
+			values[pixel] += value;
+			counts[pixel] += count;
+			break;
+		case REDUCE_DENSITY:
+			counts[pixel] += count;
+			break;
+	}
+}
+
+/*
+* Reduce the buffers of a pixel covering `area` cells to its value. Returns 0 when no cell
+* fell in the pixel
+*/
+static inline int _reduce_pixel(pixel_reducer reducer, float *values, uint32_t *counts, size_t pixel, double area, float *value) {
+	if (reducer == REDUCE_DENSITY) {
+		*value = counts[pixel] / area;
+		return counts[pixel] > 0;
+	}
+	if (reducer == REDUCE_MEAN) {
+		*value = counts[pixel] > 0 ? values[pixel] / counts[pixel] : 0;
+		return counts[pixel] > 0;
+	}
+	
+	*value = values[pixel];
+	return values[pixel] > 0;
+}
+
+void _binned_cell(cell_renderer *renderer, int x, int y, float value) {
+	binned_renderer *state = renderer->state;
+	size_t pixel = (size_t) (int) (y * state->cell_height) * state->width + (int) (x * state->cell_width);
+	_accumulate(state->reducer, state->values, state->counts, pixel, value, 1);
+}
+
+/*
+* Number of cells binned into each pixel along one axis
+*/
+uint32_t *_cells_per_pixel(int cells, int pixels, double scale) {
+	uint32_t *per_pixel = calloc(pixels > 0 ? pixels : 1, sizeof(uint32_t));
+	int i;
+	for (i = 0; i < cells; i++) {
+		per_pixel[(int) (i * scale)]++;
+	}
+	
+	return per_pixel;
+}
+
+/*
+* Reduce every pixel to a value and write the image in one go
+*/
+gdImagePtr _binned_finish(cell_renderer *renderer) {
+	binned_renderer *state = renderer->state;
+	gdImagePtr image = gdImageCreate(state->width, state->height);
+	int *colors = _allocate_colors(image, state->table);
+	
+	uint32_t *columns = NULL;
+	uint32_t *rows = NULL;
+	if (state->reducer == REDUCE_DENSITY) {
+		columns = _cells_per_pixel(state->plot_width, state->width, state->cell_width);
+		rows = _cells_per_pixel(state->plot_height, state->height, state->cell_height);
+	}
+	
+	int px, py;
+	for (py = 0; py < state->height; py++) {
+		for (px = 0; px < state->width; px++) {
+			size_t pixel = (size_t) py * state->width + px;
+			double area = columns != NULL ? (double) columns[px] * rows[py] : 1;
+			float value;
+			if (_reduce_pixel(state->reducer, state->values, state->counts, pixel, area, &value)) {
+				gdImageSetPixel(image, px, py, _pixel_color(state->table, colors, value));
+			}
+		}
+	}
+	
+	free(columns);
+	free(rows);
+	free(colors);
+	if (state->table != NULL) {
+		destroy_color_table(state->table);
+	}
+	free(state->values);
+	free(state->counts);
+	free(state);
+	free(renderer);
+	return image;
+}
+
+/*
+* Encode the rows of the band and start the next band where it ended
+*/
+void _flush_png_band(png_renderer *state) {
+	int end = state->band + PNG_BAND_ROWS < state->height ? state->band + PNG_BAND_ROWS : state->height;
+	size_t band_pixels = (size_t) PNG_BAND_ROWS * state->width;
+	int py, px;
+	for (py = state->band; py < end; py++) {
+		size_t first = (size_t) (py - state->band) * state->width;
+		if (!state->touched[py - state->band]) { // no cell fell in this row
+			memset(state->line, 0, state->width);
+			png_stream_row(state->png, state->line);
+			continue;
+		}
+		for (px = 0; px < state->width; px++) {
+			double area = state->columns != NULL ? (double) state->columns[px] * state->rows[py] : 1;
+			float value;
+			if (_reduce_pixel(state->reducer, state->values, state->counts, first + px, area, &value)) {
+				state->line[px] = _palette_index(state->table, value);
+			}
+			else {
+				state->line[px] = 0; // background
+			}
+		}
+		png_stream_row(state->png, state->line);
+	}
+	
+	if (state->values != NULL) {
+		memset(state->values, 0, band_pixels * sizeof(float));
+	}
+	if (state->counts != NULL) {
+		memset(state->counts, 0, band_pixels * sizeof(uint32_t));
+	}
+	memset(state->touched, 0, PNG_BAND_ROWS);
+	state->band = end;
+}
+
+void _png_cell(cell_renderer *renderer, int x, int y, float value) {
+	png_renderer *state = renderer->state;
+	int py = (int) (y * state->cell_height);
+	while (py >= state->band + PNG_BAND_ROWS) {
+		_flush_png_band(state);
+	}
+	
+	size_t pixel = (size_t) (py - state->band) * state->width + (int) (x * state->cell_width);
+	_accumulate(state->reducer, state->values, state->counts, pixel, value, 1);
+	state->touched[py - state->band] = 1;
+}
+
+/*
+* Encode the rows that are left and close the file. There is no image to return: whether
+* the file was written is reported through `written`
+*/
+gdImagePtr _png_finish(cell_renderer *renderer) {
+	png_renderer *state = renderer->state;
+	while (state->band < state->height) {
+		_flush_png_band(state);
+	}
+	*state->written = close_png_stream(state->png);
+	
+	if (state->table != NULL) {
+		destroy_color_table(state->table);
+	}
+	free(state->values);
+	free(state->counts);
+	free(state->columns);
+	free(state->rows);
+	free(state->line);
+	free(state);
+	free(renderer);
+	return NULL;
+}
+
+#ifdef __unix__
+tile *_tile_allocate(tile_renderer *state) {
+	size_t pixels = (size_t) state->tile_size * state->tile_size;
+	tile *t = malloc(sizeof(tile));
+	t->values = state->reducer != REDUCE_DENSITY ? calloc(pixels, sizeof(float)) : NULL;
+	t->counts = state->reducer == REDUCE_MEAN || state->reducer == REDUCE_DENSITY ? calloc(pixels, sizeof(uint32_t)) : NULL;
+	return t;
+}
+
+void _tile_free(tile *t) {
+	free(t->values);
+	free(t->counts);
+	free(t);
+}
+
+/*
+* Get a tile of the row a level is filling, allocating it on first use
+*/
+tile *_level_tile(tile_renderer *state, tile_level *level, int column) {
+	if (level->tiles[column] == NULL) {
+		level->tiles[column] = _tile_allocate(state);
+		level->filled[level->filled_count++] = column;
+	}
+	
+	return level->tiles[column];
+}
+
+/*
+* Write one tile as <directory>/<level>/<column>_<row>.png and list it in the manifest. The
+* overview level keeps its image to hand back from finish
+*/
+int _write_tile(tile_renderer *state, int l, int column, int row, tile *t) {
+	tile_level *level = &state->level[l];
+	int size = state->tile_size;
+	int width = level->width - column * size < size ? level->width - column * size : size;
+	int height = level->height - row * size < size ? level->height - row * size : size;
+	int64_t scale = (int64_t) 1 << (state->levels - 1 - l); // cells per pixel along each axis
+	
+	gdImagePtr image = gdImageCreate(width, height);
+	int *colors = _allocate_colors(image, state->table);
+	int px, py;
+	for (py = 0; py < height; py++) {
+		int64_t y = ((int64_t) row * size + py) * scale;
+		int64_t cells_y = state->plot_height - y < scale ? state->plot_height - y : scale;
+		for (px = 0; px < width; px++) {
+			int64_t x = ((int64_t) column * size + px) * scale;
+			int64_t cells_x = state->plot_width - x < scale ? state->plot_width - x : scale;
+			float value;
+			if (_reduce_pixel(state->reducer, t->values, t->counts, (size_t) py * size + px, (double) cells_x * cells_y, &value)) {
+				gdImageSetPixel(image, px, py, _pixel_color(state->table, colors, value));
+			}
+		}
+	}
+	free(colors);
+	
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s/%d/%d_%d.png", state->directory, l, column, row);
+	int ok = write_image(image, path);
+	if (l == state->overview) {
+		state->image = image;
+	}
+	else {
+		gdImageDestroy(image);
+	}
+	
+	json_begin_array(state->manifest);
+	json_int(state->manifest, l);
+	json_int(state->manifest, column);
+	json_int(state->manifest, row);
+	json_end_array(state->manifest);
+	return ok;
+}
+
+/*
+* Fold a tile into its quarter of the tile above it, two by two pixels at a time
+*/
+void _downsample_tile(tile_renderer *state, int l, int column, int row, tile *t) {
+	tile_level *parent = &state->level[l-1];
+	tile *p = _level_tile(state, parent, column / 2);
+	int size = state->tile_size;
+	int offset_x = (column % 2) * size;
+	int offset_y = (row % 2) * size;
+	int px, py;
+	for (py = 0; py < size; py++) {
+		for (px = 0; px < size; px++) {
+			size_t pixel = (size_t) py * size + px;
+			size_t target = (size_t) ((offset_y + py) / 2) * size + (offset_x + px) / 2;
+			if (t->counts != NULL) {
+				if (t->counts[pixel] > 0) {
+					_accumulate(state->reducer, p->values, p->counts, target, t->values != NULL ? t->values[pixel] : 0, t->counts[pixel]);
+				}
+			}
+			else if (t->values[pixel] > 0) {
+				_accumulate(state->reducer, p->values, p->counts, target, t->values[pixel], 0);
+			}
+		}
+	}
+}
+
+/*
+* Write out the row of tiles a level is filling and pass it on to the level above. A row of
+* the level above is complete once both of the rows below it are
+*/
+void _flush_tile_row(tile_renderer *state, int l) {
+	tile_level *level = &state->level[l];
+	int i;
+	for (i = 0; i < level->filled_count; i++) {
+		int column = level->filled[i];
+		tile *t = level->tiles[column];
+		if (!_write_tile(state, l, column, level->row, t)) {
+			state->failed = 1;
+		}
+		if (l > 0) {
+			_downsample_tile(state, l, column, level->row, t);
+		}
+		_tile_free(t);
+		level->tiles[column] = NULL;
+	}
+	level->filled_count = 0;
+	
+	int row = level->row++;
+	if (l > 0 && (row % 2 == 1 || row == level->rows - 1)) {
+		_flush_tile_row(state, l-1);
+	}
+}
+
+void _tile_cell(cell_renderer *renderer, int x, int y, float value) {
+	tile_renderer *state = renderer->state;
+	tile_level *base = &state->level[state->levels - 1];
+	int size = state->tile_size;
+	while (base->row < y / size) { // cells come in row order, so rows above are done
+		_flush_tile_row(state, state->levels - 1);
+	}
+	
+	tile *t = _level_tile(state, base, x / size);
+	_accumulate(state->reducer, t->values, t->counts, (size_t) (y % size) * size + x % size, value, 1);
+}
+
+/*
+* Flush every remaining row, so each level is written down to its single top tile, and
+* close the manifest. Returns the overview image, or NULL if anything couldn't be written
+*/
+gdImagePtr _tile_finish(cell_renderer *renderer) {
+	tile_renderer *state = renderer->state;
+	tile_level *base = &state->level[state->levels - 1];
+	while (base->row < base->rows) {
+		_flush_tile_row(state, state->levels - 1);
+	}
+	
+	json_end_array(state->manifest);
+	json_end_object(state->manifest);
+	if (!destroy_json_writer(state->manifest) | (fclose(state->manifest_file) != 0)) {
+		state->failed = 1;
+	}
+	
+	gdImagePtr image = state->image;
+	if (image == NULL) { // nothing fell in the overview: it is blank
+		tile_level *overview = &state->level[state->overview];
+		image = gdImageCreate(overview->width, overview->height);
+		gdImageColorAllocate(image, 255, 255, 255);
+	}
+	if (state->failed) {
+		gdImageDestroy(image);
+		image = NULL;
+	}
+	
+	int l;
+	for (l = 0; l < state->levels; l++) {
+		free(state->level[l].tiles);
+		free(state->level[l].filled);
+	}
+	free(state->level);
+	if (state->table != NULL) {
+		destroy_color_table(state->table);
+	}
+	free(state->directory);
+	free(state);
+	free(renderer);
+	return image;
+}
+#endif
+
+static inline int _first_row(alignment *algn) {
+	return algn->dir == UR ? algn->y - algn->length + 1 : algn->y;
+}
+
+int _compare_cells_by_x(const void *a, const void *b) {
+	const scored_cell *c1 = a, *c2 = b;
+	return (c1->x > c2->x) - (c1->x < c2->x);
+}
+
+sparse_dotplot *_sparse_allocate(int width, int height, size_t count) {
+	sparse_dotplot *sp = malloc(sizeof(sparse_dotplot));
+	sp->width = width;
+	sp->height = height;
+	sp->cells = malloc((count > 0 ? count : 1) * sizeof(scored_cell));
+	sp->count = count;
+	return sp;
+}
+
+/*
+* Expand the cells of alignments that fall in rows [first, last) in row order. Cells are
+* bucketed by row with a counting sort so the cost follows the number of cells rather than
+* the area of the plot. A cell where two alignments cross is kept once
+*/
+sparse_dotplot *_sparse_from_rows(int width, int height, alignment *items, size_t count, int first, int last) {
+	int rows = last - first;
+	size_t *offsets = calloc((size_t) rows + 2, sizeof(size_t));
+	size_t a, total;
+	for (a = 0; a < count; a++) { // rows covered by each alignment, as differences
+		int top = _first_row(&items[a]);
+		int bottom = top + items[a].length;
+		top = top > first ? top : first;
+		bottom = bottom < last ? bottom : last;
+		if (top < bottom) {
+			offsets[top - first + 1]++;
+			offsets[bottom - first + 1]--;
+		}
+	}
+	
+	int y;
+	size_t covering = 0;
+	for (y = 0; y < rows; y++) { // cells per row, then where each row starts
+		covering += offsets[y + 1];
+		offsets[y + 1] = offsets[y] + covering;
+	}
+	total = offsets[rows];
+	
+	sparse_dotplot *sp = _sparse_allocate(width, height, total);
+	size_t *next = malloc(((size_t) rows + 1) * sizeof(size_t));
+	memcpy(next, offsets, ((size_t) rows + 1) * sizeof(size_t));
+	for (a = 0; a < count; a++) {
+		alignment *algn = &items[a];
+		int top = _first_row(algn);
+		int bottom = top + algn->length;
+		for (y = top > first ? top : first; y < bottom && y < last; y++) {
+			scored_cell c = {algn->x + (algn->dir == UR ? algn->y - y : y - algn->y), y, 1.0};
+			sp->cells[next[y - first]++] = c;
+		}
+	}
+	free(next);
+	
+	size_t kept = 0;
+	for (y = 0; y < rows; y++) { // order each row by x and drop the cells seen twice
+		scored_cell *row = sp->cells + offsets[y];
+		size_t n = offsets[y + 1] - offsets[y];
+		size_t i;
+		if (n > 1) {
+			qsort(row, n, sizeof(scored_cell), _compare_cells_by_x);
+		}
+		for (i = 0; i < n; i++) {
+			if (i == 0 || row[i].x != row[i-1].x) {
+				sp->cells[kept++] = row[i];
+			}
+		}
+	}
+	sp->count = kept;
+	
+	free(offsets);
+	return sp;
+}
+
+sparse_dotplot *_sparse_from_alignments(int width, int height, alignment_array *alignments) {
+	return _sparse_from_rows(width, height, alignments->items, alignments->count, 0, height);
+}
+
+/*
+* Score a band of the cells of a sparse dotplot
+*/
+void _filter_cells(void *arg, int task) {
+	sparse_filter_job *job = (sparse_filter_job*) arg;
+	sparse_dotplot *sp = job->filtered;
+	filter *f = job->f;
+	size_t start, end, i;
+	_band_sized(sp->count, job->tasks, task, &start, &end);
+	for (i = start; i < end; i++) {
+		scored_cell *c = &sp->cells[i];
+		if (c->x < f->width && c->y < f->height) {
+			c->value = _filter_value(f, c->x, c->y);
+		}
+	}
+}
+
+/*
+* Score one cell through every round of a pipeline. Like apply_filter, a round leaves cells
+* that are already at 0 and cells outside the filter alone
+*/
+static inline float _pipeline_value(filter_pipeline *pipeline, float value, int x, int y) {
+	float epsilon = 0.00001;
+	int r;
+	for (r = 0; r < pipeline->count; r++) {
+		filter *f = pipeline->rounds[r];
+		if (value < epsilon && value > -epsilon) {
+			break;
+		}
+		if (x < f->width && y < f->height) {
+			value = _filter_value(f, x, y);
+		}
+	}
+	
+	return value;
+}
+
+/*
+* Order alignments by strand, then diagonal, then x, as stored in binary alignment files
+*/
+int _compare_by_diagonal(const void *a, const void *b) {
+	const alignment *r1 = a, *r2 = b;
+	if (r1->dir != r2->dir) {
+		return r1->dir == UR ? -1 : 1;
+	}
+	
+	int64_t d1 = alignment_diagonal(r1->x, r1->y, r1->dir);
+	int64_t d2 = alignment_diagonal(r2->x, r2->y, r2->dir);
+	if (d1 != d2) {
+		return d1 < d2 ? -1 : 1;
+	}
+	return (r1->x > r2->x) - (r1->x < r2->x);
+}
+
+uint8_t *_put_varint(uint8_t *out, uint64_t value) {
+	while (value >= 0x80) {
+		*out++ = (uint8_t) value | 0x80;
+		value >>= 7;
+	}
+	*out++ = (uint8_t) value;
+	return out;
+}
+
+uint64_t _zigzag(int64_t value) {
+	return ((uint64_t) value << 1) ^ (uint64_t) (value >> 63);
+}
+
+/*
+* Wrap runs from one of the engines as an alignment array. The array takes over the runs
+*/
+alignment_array *_runs_to_alignments(run *runs, size_t count) {
+	alignment_array *alignments = malloc(sizeof(alignment_array));
+	alignments->items = runs;
+	alignments->count = count;
+	alignments->capacity = count;
+	return alignments;
+}
+
+/*
+* Walk a single diagonal from (x, y) in steps of (dx, 1) and collect every stretch of at
+* least matchLength matches
+*/
+void _find_runs(match_source *source, alignment_array *alignments, int x, int y, int dx, int matchLength) {
+	int stretch = 0;
+	while (x >= 0 && x < source->width && y < source->height) {
+		if (_is_match(source, x, y)) {
+			stretch++;
+		}
+		else {
+			if (stretch >= matchLength) { // no match, but nonmatch terminated a long enough stretch for inclusion
+				if (dx < 0) {
+					_push_alignment(alignments, x+1, y-1, UR, stretch);
+				}
+				else {
+					_push_alignment(alignments, x-stretch, y-stretch, LR, stretch);
+				}
+			}
+			stretch = 0;
+		}
+		
+		x += dx;
+		y++;
+	}
+	
+	if (stretch >= matchLength) {
+		if (dx < 0) {
+			_push_alignment(alignments, x+1, y-1, UR, stretch);
+		}
+		else {
+			_push_alignment(alignments, x-stretch, y-stretch, LR, stretch);
+		}
+	}
+}
+
+/*
+* Same as _find_runs for packed sequences, comparing 32 cells of the diagonal at a time
+*/
+void _find_runs_packed(match_source *source, alignment_array *alignments, int x, int y, int dx, int matchLength) {
+	int steps = dx < 0 ? x + 1 : source->width - x;
+	if (source->height - y < steps) {
+		steps = source->height - y;
+	}
+	
+	int stretch = 0;
+	int step = 0;
+	while (step < steps) {
+		int count = steps - step < 32 ? steps - step : 32;
+		uint32_t matches;
+		if (dx < 0) { // x - step in seq1 is (width-1 - x) + step in its reverse
+			matches = packed_diagonal_matches(source->reversed1, source->width-1 - x + step, source->packed2, y + step, count);
+		}
+		else {
+			matches = packed_diagonal_matches(source->packed1, x + step, source->packed2, y + step, count);
+		}
+		
+		int t = 0;
+		while (t < count) {
+			uint32_t rest = matches >> t;
+			if (rest & 1) { // extend the stretch by the whole block of matches
+				int ones = rest == 0xffffffff ? 32 : __builtin_ctz(~rest);
+				if (ones > count - t) {
+					ones = count - t;
+				}
+				stretch += ones;
+				t += ones;
+			}
+			else {
+				if (stretch >= matchLength) { // the stretch ended at the previous step
+					int last = step + t - 1;
+					if (dx < 0) {
+						_push_alignment(alignments, x - last, y + last, UR, stretch);
+					}
+					else {
+						_push_alignment(alignments, x + last - stretch + 1, y + last - stretch + 1, LR, stretch);
+					}
+				}
+				stretch = 0;
+				t += rest == 0 ? count - t : __builtin_ctz(rest);
+			}
+		}
+		
+		step += count;
+	}
+	
+	if (stretch >= matchLength) {
+		int last = steps - 1;
+		if (dx < 0) {
+			_push_alignment(alignments, x - last, y + last, UR, stretch);
+		}
+		else {
+			_push_alignment(alignments, x + last - stretch + 1, y + last - stretch + 1, LR, stretch);
+		}
+	}
+}
+
+/*
+* Scan a band of diagonals. Diagonal i starts along the top row for i < width and then
+* down the right (dx < 0) or left (dx > 0) column
+*/
+void _find_diagonal_band(void *arg, int task) {
+	diagonal_job *job = (diagonal_job*) arg;
+	match_source *source = job->source;
+	alignment_array *found = create_alignment_array();
+	int start, end, i;
+	_band(source->width + source->height - 1, job->tasks, task, &start, &end);
+	for (i = start; i < end; i++) {
+		int x, y;
+		if (i < source->width) { // top row
+			x = job->dx < 0 ? source->width-1 - i : i;
+			y = 0;
+		}
+		else { // right or left column
+			x = job->dx < 0 ? source->width-1 : 0;
+			y = i - source->width + 1;
+		}
+		if (source->packed1 != NULL) {
+			_find_runs_packed(source, found, x, y, job->dx, job->matchLength);
+		}
+		else {
+			_find_runs(source, found, x, y, job->dx, job->matchLength);
+		}
+	}
+	
+	job->found[task] = found;
+}
+
+void _find_diagonals(match_source *source, alignment_array *alignments, int dx, int matchLength) {
+	if (source->width == 0 || source->height == 0) {
+		return;
+	}
+	
+	int tasks = _task_count(source->width + source->height - 1);
+	alignment_array *found[tasks];
+	diagonal_job job = {
+		.source = source,
+		.found = found,
+		.dx = dx,
+		.matchLength = matchLength,
+		.tasks = tasks
+	};
+	pool_run(thread_count, tasks, _find_diagonal_band, &job);
+	
+	int i;
+	for (i = 0; i < tasks; i++) {
+		_append_alignments(alignments, found[i]);
+	}
+}
+
+/*
+* Get left diagonal coordinates for alignments
+*/
+void _find_left_diagonals(match_source *source, alignment_array *alignments, int matchLength) {
+	_find_diagonals(source, alignments, -1, matchLength);
+}
+
+/*
+* Get right diagonal coordinates for alignments
+*/
+void _find_right_diagonals(match_source *source, alignment_array *alignments, int matchLength) {
+	_find_diagonals(source, alignments, 1, matchLength);
+}
+
+filter *_filter_allocate(int width, int height) {
+	int i;
+	float **cells;
+	cells = (float**) malloc(width * sizeof(float*));
+	for (i = 0; i < width; i++) {
+		cells[i] = (float*) malloc(height * sizeof(float));
+	}
+	
+	filter *f = (filter *) malloc(sizeof(filter));
+	f->width = width;
+	f->height = height;
+	f->cells = cells;
+	f->x_values = NULL;
+	f->y_values = NULL;
+	
+	return f;
+}
+
+/*
+* Wrap row and column values as a separable filter, which takes ownership of them
+*/
+filter *_separable_filter_wrap(int width, int height, float *x_values, float *y_values) {
+	filter *f = (filter *) malloc(sizeof(filter));
+	f->width = width;
+	f->height = height;
+	f->cells = NULL;
+	f->x_values = x_values;
+	f->y_values = y_values;
+	
+	return f;
+}
+
+/************** Public  **************/
+dotplot *create_dotplot(char *seq1, char *seq2) {
+	dotplot *dp = _dotplot_allocate(strlen(seq1), strlen(seq2));
+	row_job job = {
+		.dp = dp,
+		.seq1 = seq1,
+		.seq2 = seq2,
+		.kernel = choose_match_kernel(),
+		.tasks = _task_count(dp->height)
+	};
+	pool_run(thread_count, job.tasks, _match_rows, &job);
+	
+	return dp;
+}
+
+/*
+* Clip a viewport to the sequences. Looking for their ends stops at the viewport, so a
+* viewport near the start of long sequences never scans the rest of them
+*/
+viewport _clip_viewport(char *seq1, char *seq2, viewport view) {
+	int width = view.x1 > 0 ? (int) strnlen(seq1, view.x1) : 0;
+	int height = view.y1 > 0 ? (int) strnlen(seq2, view.y1) : 0;
+	view.x0 = view.x0 < 0 ? 0 : view.x0 > width ? width : view.x0;
+	view.y0 = view.y0 < 0 ? 0 : view.y0 > height ? height : view.y0;
+	view.x1 = width;
+	view.y1 = height;
+	return view;
+}
+
+/*
+* The dotplot of one window of the sequences: cell (x, y) is (view.x0 + x, view.y0 + y) of
+* the whole plot. Rows are matched straight out of the sequences, nothing is copied
+*/
+dotplot *create_dotplot_viewport(char *seq1, char *seq2, viewport view) {
+	view = _clip_viewport(seq1, seq2, view);
+	dotplot *dp = _dotplot_allocate(view.x1 - view.x0, view.y1 - view.y0);
+	row_job job = {
+		.dp = dp,
+		.seq1 = seq1 + view.x0,
+		.seq2 = seq2 + view.y0,
+		.kernel = choose_match_kernel(),
+		.tasks = _task_count(dp->height)
+	};
+	pool_run(thread_count, job.tasks, _match_rows, &job);
+	
+	return dp;
+}
+
+/*
+* Same as create_dotplot for sequences packed with pack_sequence
+*/
+dotplot *create_dotplot_packed(packed_sequence *seq1, packed_sequence *seq2) {
+	dotplot *dp = _dotplot_allocate(seq1->length, seq2->length);
+	packed_row_job job = {
+		.dp = dp,
+		.seq1 = seq1,
+		.seq2 = seq2,
+		.tasks = _task_count(dp->height)
+	};
+	pool_run(thread_count, job.tasks, _match_packed_rows, &job);
+	
+	return dp;
+}
+
+#ifdef __unix__
+/*
+* The first record of a FASTA file, NULL if the file can't be read or has no records
+*/
+char *_read_first_record(char *filename) {
+	fasta_file *file = open_fasta(filename);
+	if (file == NULL) {
+		return NULL;
+	}
+	
+	char *seq = file->count > 0 ? read_fasta_record(file, &file->records[0]) : NULL;
+	close_fasta(file);
+	return seq;
+}
+
+dotplot *create_dotplot_from_fasta(char *file1, char *file2) {
+	char *seq1 = _read_first_record(file1);
+	char *seq2 = _read_first_record(file2);
+	if (seq1 == NULL || seq2 == NULL) {
+		free(seq1);
+		free(seq2);
+		return NULL;
+	}
+	
+	dotplot *dp = create_dotplot(seq1, seq2);
+	
+	free(seq1);
+	free(seq2);
+	return dp;
+}
+#endif
+
+dotplot *zero_dotplot(dotplot *dp) {
+	return _dotplot_allocate(dp->width, dp->height); // allocation already clears every cell
+}
+
+dotplot *clone_dotplot(dotplot *dp) {
+	dotplot *clone = _dotplot_allocate(dp->width, dp->height);
+	memcpy(clone->bits, dp->bits, dp->stride * (size_t) dp->height * sizeof(uint64_t));
+	if (dp->scores != NULL) {
+		size_t size = (size_t) dp->width * dp->height * sizeof(float);
+		clone->scores = (float*) malloc(size);
+		memcpy(clone->scores, dp->scores, size);
+	}
+	
+	return clone;
+}
+
+void destroy_dotplot(dotplot *dp) {
+	free(dp->bits);
+	free(dp->scores);
+	list_destroy(dp->regions);
+	free(dp);
+}
+
+/*
+* Return a list of alignments as (x, y) coordinates.
+* Alignments are always oriented in the direction of the first sequence passed
+*
+* Runs are found 64 cells at a time on the packed rows (see bitrun.c)
+*/
+alignment_array *find_alignments(dotplot *dp, int length) {
+	size_t count;
+	uint64_t *bits = dp->bits;
+	if (dp->scores != NULL) { // cells filtered down to a score of 0 don't take part
+		size_t words = dp->stride * (size_t) dp->height;
+		int x, y;
+		bits = malloc(words * sizeof(uint64_t));
+		memcpy(bits, dp->bits, words * sizeof(uint64_t));
+		for (y = 0; y < dp->height; y++) {
+			for (x = 0; x < dp->width; x++) {
+				if (dp->scores[(size_t) y * dp->width + x] <= 0) {
+					bits[(size_t) y * dp->stride + (x >> 6)] &= ~((uint64_t) 1 << (x & 63));
+				}
+			}
+		}
+	}
+	
+	run *runs = bitrun_find_runs(bits, dp->stride, dp->width, dp->height, length, thread_count, &count);
+	if (bits != dp->bits) {
+		free(bits);
+	}
+	return _runs_to_alignments(runs, count);
+}
+
+/*
+* Same as find_alignments, walking each diagonal one cell at a time
+*/
+alignment_array *find_alignments_scalar(dotplot *dp, int length) {
+	match_source source = {
+		.dp = dp,
+		.width = dp->width,
+		.height = dp->height
+	};
+	alignment_array *alignments = create_alignment_array();
+	_find_left_diagonals(&source, alignments, length);
+	_find_right_diagonals(&source, alignments, length);
+	
+	return alignments;
+}
+
+/*
+* Same as find_alignments on create_dotplot(seq1, seq2), but each diagonal is streamed
+* straight from the sequences so the match matrix is never allocated
+*/
+alignment_array *find_alignments_from_sequences(char *seq1, char *seq2, int length) {
+	match_source source = {
+		.dp = NULL,
+		.seq1 = seq1,
+		.seq2 = seq2,
+		.width = strlen(seq1),
+		.height = strlen(seq2)
+	};
+	alignment_array *alignments = create_alignment_array();
+	_find_left_diagonals(&source, alignments, length);
+	_find_right_diagonals(&source, alignments, length);
+	
+	return alignments;
+}
+
+/*
+* Same as find_alignments_from_sequences for sequences packed with pack_sequence. Each
+* diagonal is compared 32 bases at a time
+*/
+alignment_array *find_alignments_packed(packed_sequence *seq1, packed_sequence *seq2, int length) {
+	match_source source = {
+		.dp = NULL,
+		.packed1 = seq1,
+		.reversed1 = reverse_packed_sequence(seq1),
+		.packed2 = seq2,
+		.width = seq1->length,
+		.height = seq2->length
+	};
+	alignment_array *alignments = create_alignment_array();
+	_find_left_diagonals(&source, alignments, length);
+	_find_right_diagonals(&source, alignments, length);
+	
+	destroy_packed_sequence(source.reversed1);
+	return alignments;
+}
+
+/*
+* Same result as find_alignments_from_sequences, but seeded from k-mer hits so runtime
+* follows the number of matching k-mers instead of the matrix area. Sequences that are not
+* pure ACGT fall back to the diagonal scan
+*/
+alignment_array *find_alignments_kmer(char *seq1, char *seq2, int length) {
+	size_t count;
+	run *runs = kmer_find_runs(seq1, strlen(seq1), seq2, strlen(seq2), length, thread_count, &count);
+	if (runs == NULL) {
+		return find_alignments_from_sequences(seq1, seq2, length);
+	}
+	
+	return _runs_to_alignments(runs, count);
+}
+
+/*
+* Same result as find_alignments_from_sequences for the sequence the index was built from,
+* found through its suffix array. Build the index once with create_suffix_index (or load it
+* with read_suffix_index) and reuse it for every query against the same reference
+*/
+alignment_array *find_alignments_indexed(suffix_index *index, char *seq2, int length) {
+	size_t count;
+	run *runs = suffix_find_runs(index, seq2, strlen(seq2), length, thread_count, &count);
+	return _runs_to_alignments(runs, count);
+}
+
+/*
+* Apply alignments returned by find_alignments
+*/
+dotplot *apply_alignments(dotplot *dp, alignment_array *alignments) {
+	return create_dotplot_from_alignments(dp->width, dp->height, alignments);
+}
+
+/*
+* Build a dotplot holding only the cells of the given alignments. This is what
+* apply_alignments returns, without needing the unfiltered dotplot
+*/
+dotplot *create_dotplot_from_alignments(int width, int height, alignment_array *alignments) {
+	dotplot *filtered = _dotplot_allocate(width, height);
+	size_t a;
+	for (a = 0; a < alignments->count; a++) {
+		alignment *algn = &alignments->items[a];
+		int dy = algn->dir == UR ? -1 : 1;
+		
+		int i;
+		for (i = 0; i < algn->length; i++) { // fill the diagonal straight from the run
+			_set_bit(filtered, algn->x + i, algn->y + i * dy);
+		}
+	}
+	
+	return filtered;
+}
+
+alignment_array *create_alignment_array() {
+	alignment_array *alignments = malloc(sizeof(alignment_array));
+	alignments->items = NULL;
+	alignments->count = 0;
+	alignments->capacity = 0;
+	return alignments;
+}
+
+void destroy_alignments(alignment_array *alignments) {
+	free(alignments->items);
+	free(alignments);
+}
+
+/*
+* List view of an alignment array for callers that still want a list_t. The nodes point
+* into the array, so free the list with list_destroy before destroying the array
+*/
+list_t *alignments_as_list(alignment_array *alignments) {
+	list_t *list = list_new();
+	size_t a;
+	for (a = 0; a < alignments->count; a++) {
+		list_rpush(list, list_node_new(&alignments->items[a]));
+	}
+	
+	return list;
+}
+
+/*
+* Print alignments list as JSON of the format
+* [
+*   {
+*     "sequence": "ACTG",
+*     "position": {
+*       "x": 1,
+*       "y": 1
+*     }
+*   }
+* ]
+*/
+void print_alignments(alignment_array *alignments, char *seq1, char *seq2) {
+	json_writer *writer = create_json_writer(stdout, JSON_COMPACT);
+	write_alignments(writer, alignments, seq1);
+	destroy_json_writer(writer);
+}
+
+int write_alignments(json_writer *writer, alignment_array *alignments, char *seq1) {
+	size_t j;
+	
+	json_begin_array(writer);
+	for (j = 0; j < alignments->count; j++) {
+		alignment *algn = &alignments->items[j];
+		
+		json_begin_object(writer);
+		json_key(writer, "sequence");
+		json_string(writer, seq1 + algn->x, algn->length); // the run is a slice of seq1
+		json_key(writer, "position");
+		json_begin_object(writer);
+		json_key(writer, "x");
+		json_int(writer, algn->x);
+		json_key(writer, "y");
+		json_int(writer, algn->y);
+		json_end_object(writer);
+		json_end_object(writer);
+	}
+	json_end_array(writer);
+	
+	return json_flush(writer);
+}
+
+int write_alignments_binary(alignment_array *alignments, int width, int height, char *filename, int compress) {
+	size_t count = alignments->count;
+	alignment *sorted = malloc((count > 0 ? count : 1) * sizeof(alignment));
+	if (count > 0) {
+		memcpy(sorted, alignments->items, count * sizeof(alignment));
+	}
+	qsort(sorted, count, sizeof(alignment), _compare_by_diagonal);
+	
+	FILE *out = fopen(filename, "wb");
+	if (!out) {
+		free(sorted);
+		return 0;
+	}
+	
+	alignment_file_header header = {
+		.version = ALIGNMENT_FILE_VERSION,
+		.flags = compress ? ALIGNMENT_FILE_VARINT : 0,
+		.width = width,
+		.height = height,
+		.reserved = 0,
+		.count = count
+	};
+	memcpy(header.magic, ALIGNMENT_FILE_MAGIC, 4);
+	int ok = fwrite(&header, sizeof(header), 1, out) == 1;
+	
+	size_t i;
+	if (compress) { // 3 varints of at most 10 bytes each per record
+		uint8_t *data = malloc(count * 30 + 1);
+		uint8_t *end = data;
+		int64_t diagonal = 0;
+		int x = 0;
+		for (i = 0; i < count; i++) {
+			int64_t d = alignment_diagonal(sorted[i].x, sorted[i].y, sorted[i].dir);
+			end = _put_varint(end, _zigzag(d - diagonal));
+			end = _put_varint(end, _zigzag((int64_t) sorted[i].x - x));
+			end = _put_varint(end, (uint64_t) sorted[i].length << 1 | (sorted[i].dir == LR));
+			diagonal = d;
+			x = sorted[i].x;
+		}
+		ok = ok && fwrite(data, 1, end - data, out) == (size_t) (end - data);
+		free(data);
+	}
+	else {
+		alignment_record *records = malloc((count > 0 ? count : 1) * sizeof(alignment_record));
+		for (i = 0; i < count; i++) {
+			alignment_record record = {sorted[i].x, sorted[i].y, sorted[i].length, sorted[i].dir};
+			records[i] = record;
+		}
+		ok = ok && fwrite(records, sizeof(alignment_record), count, out) == count;
+		free(records);
+	}
+	
+	if (fclose(out) != 0) {
+		ok = 0;
+	}
+	free(sorted);
+	return ok;
+}
+
+#ifdef __unix__
+alignment_array *read_alignments_binary(char *filename) {
+	alignment_file *file = open_alignment_file(filename);
+	if (file == NULL) {
+		return NULL;
+	}
+	
+	alignment_array *alignments = create_alignment_array();
+	alignment_cursor cursor = {0};
+	alignment algn;
+	while (next_alignment(file, &cursor, &algn)) {
+		push_run(&alignments->items, &alignments->count, &alignments->capacity, algn);
+	}
+	
+	int complete = cursor.index == file->count;
+	close_alignment_file(file);
+	if (!complete) { // corrupt compressed records
+		destroy_alignments(alignments);
+		return NULL;
+	}
+	return alignments;
+}
+#endif
+
+dotplot *apply_filter(dotplot *dp, filter *f) {
+	int dp_max_x = dp->width;
+	int dp_max_y = dp->height;
+	int f_max_x = f->width;
+	int f_max_y = f->height;
+	
+	dotplot *filtered = clone_dotplot(dp);
+	/* The maximums are the maximum number of elements to iterate over and will always be the smaller number */
+	int max_x = dp_max_x < f_max_x ? dp_max_x : f_max_x;
+	int max_y = dp_max_y < f_max_y ? dp_max_y : f_max_y;
+	
+	_dotplot_scores(filtered); // create the score plane before the workers write into it
+	filter_job job = {
+		.filtered = filtered,
+		.f = f,
+		.max_x = max_x,
+		.max_y = max_y,
+		.tasks = _task_count(max_y)
+	};
+	pool_run(thread_count, job.tasks, _filter_rows, &job);
+	
+	return filtered;
+}
+
+dotplot *apply_filter_safe(dotplot *dp, filter *f) {
+	if (dp->width != f->width || dp->height != f->height) {
+		return NULL;
+	}
+	
+	return apply_filter(dp, f);
+}
+
+/* Filter pipeline stuff */
+filter_pipeline *create_filter_pipeline(int width, int height) {
+	filter_pipeline *pipeline = malloc(sizeof(filter_pipeline));
+	pipeline->width = width;
+	pipeline->height = height;
+	pipeline->rounds = NULL;
+	pipeline->count = 0;
+	pipeline->capacity = 0;
+	pipeline->mask = NULL;
+	
+	return pipeline;
+}
+
+void destroy_filter_pipeline(filter_pipeline *pipeline) {
+	free(pipeline->rounds);
+	free(pipeline);
+}
+
+/*
+* Add a round of filtering, applied after the rounds already added
+*/
+void add_filter_round(filter_pipeline *pipeline, filter *f) {
+	if (pipeline->count == pipeline->capacity) {
+		pipeline->capacity = pipeline->capacity > 0 ? pipeline->capacity * 2 : 4;
+		pipeline->rounds = realloc(pipeline->rounds, pipeline->capacity * sizeof(filter*));
+	}
+	
+	pipeline->rounds[pipeline->count++] = f;
+}
+
+/*
+* Only score cells covered by one of the alignments, as if the dotplot had gone through
+* apply_alignments first
+*/
+void set_alignment_mask(filter_pipeline *pipeline, alignment_array *alignments) {
+	pipeline->mask = alignments;
+}
+
+/*
+* Visit every match of dp once, in row order, score it through all rounds and hand the cells
+* left above 0 to the renderer. With a mask only the cells of its alignments are visited, so
+* the cost follows the number of cells and dp may be NULL. Returns the renderer's image
+*/
+gdImagePtr run_filter_pipeline(filter_pipeline *pipeline, dotplot *dp, cell_renderer *renderer) {
+	if (pipeline->mask != NULL) {
+		int width = dp != NULL ? dp->width : pipeline->width;
+		int height = dp != NULL ? dp->height : pipeline->height;
+		sparse_dotplot *masked = _sparse_from_alignments(width, height, pipeline->mask);
+		size_t i;
+		for (i = 0; i < masked->count; i++) {
+			scored_cell *c = &masked->cells[i];
+			float value = _pipeline_value(pipeline, dp != NULL ? get_value(dp, c->x, c->y) : 1.0, c->x, c->y);
+			if (value > 0) {
+				renderer->cell(renderer, c->x, c->y, value);
+			}
 		}
+		
+		destroy_sparse_dotplot(masked);
+		return renderer->finish(renderer);
 	}
 	
-	return clone;
-}
-
-void destroy_dotplot(dotplot *dp) {
-	float **cells = dp->cells;
-	int x;
-	for (x = 0; x < dp->width; x++) {
-		free(cells[x]);
+	int y;
+	size_t w;
+	for (y = 0; y < dp->height; y++) {
+		uint64_t *row = dp->bits + (size_t) y * dp->stride;
+		float *scores = dp->scores != NULL ? dp->scores + (size_t) y * dp->width : NULL;
+		for (w = 0; w < dp->stride; w++) {
+			uint64_t word = row[w];
+			while (word) { // only visit matches
+				int x = (int) (w * 64) + __builtin_ctzll(word);
+				word &= word - 1;
+				
+				float value = _pipeline_value(pipeline, scores != NULL ? scores[x] : 1.0, x, y);
+				if (value > 0) {
+					renderer->cell(renderer, x, y, value);
+				}
+			}
+		}
 	}
 	
-	free(cells);
-	list_destroy(dp->regions);
-	free(dp);
+	return renderer->finish(renderer);
 }
 
+/* Tiled comparison stuff */
 /*
-* Return a list of alignments as (x, y) coordinates.
-* Alignments are always oriented in the direction of the first sequence passed
+* The runs of at least length cells that have a cell in [x0, x1) x [y0, y1), at full length
+* and in the coordinates of the whole sequences (x1 and y1 can't be past their ends). The
+* window is compared with a margin of length cells on every side, which shows at least
+* length cells of every such run; a run cut off by the margin is then extended straight
+* from the sequences, so only O(window) cells are ever compared in the matrix
 */
-list_t *find_alignments(dotplot *dp, int length) {
-	list_t *leftAlignments = _find_left_diagonals(dp, length);
-	list_t *rightAlignments = _find_right_diagonals(dp, length);
+alignment_array *_window_alignments(char *seq1, char *seq2, int x0, int y0, int x1, int y1, int length) {
+	int wx0 = x0 - length > 0 ? x0 - length : 0;
+	int wy0 = y0 - length > 0 ? y0 - length : 0;
+	int wx1 = x1 + (int) strnlen(seq1 + x1, length);
+	int wy1 = y1 + (int) strnlen(seq2 + y1, length);
+	viewport area = {wx0, wy0, wx1, wy1};
+	dotplot *window = create_dotplot_viewport(seq1, seq2, area);
+	alignment_array *found = find_alignments(window, length);
+	destroy_dotplot(window);
 	
-	list_node_t *node;
-	list_iterator_t *it = list_iterator_new(rightAlignments, LIST_HEAD);
-	while ((node = list_iterator_next(it))) {
-		list_rpush(leftAlignments, list_node_new(_reverse_alignment(node->val)));
+	size_t i, kept = 0;
+	for (i = 0; i < found->count; i++) {
+		alignment a = found->items[i];
+		a.x += wx0;
+		a.y += wy0;
+		int first, last; // the cells i of the run in the window, first <= i < last
+		if (a.dir == LR) { // cell i is (x + i, y + i)
+			first = x0 - a.x > y0 - a.y ? x0 - a.x : y0 - a.y;
+			last = x1 - a.x < y1 - a.y ? x1 - a.x : y1 - a.y;
+		}
+		else { // cell i is (x + i, y - i)
+			first = x0 - a.x > a.y - y1 + 1 ? x0 - a.x : a.y - y1 + 1;
+			last = x1 - a.x < a.y - y0 + 1 ? x1 - a.x : a.y - y0 + 1;
+		}
+		if ((first > 0 ? first : 0) >= (last < a.length ? last : a.length)) {
+			continue; // only in the margin
+		}
+		
+		if (a.dir == LR) { // follow the run up and left, then down and right, past the window
+			while (a.x > 0 && a.y > 0 && (a.x - 1 < wx0 || a.y - 1 < wy0) && seq1[a.x - 1] == seq2[a.y - 1]) {
+				a.x--;
+				a.y--;
+				a.length++;
+			}
+			while ((a.x + a.length >= wx1 || a.y + a.length >= wy1) && seq1[a.x + a.length] != '\0'
+				&& seq1[a.x + a.length] == seq2[a.y + a.length]) {
+				a.length++;
+			}
+		}
+		else { // up and right, then down and left
+			while (a.y - a.length >= 0 && (a.x + a.length >= wx1 || a.y - a.length < wy0) && seq1[a.x + a.length] != '\0'
+				&& seq1[a.x + a.length] == seq2[a.y - a.length]) {
+				a.length++;
+			}
+			while (a.x > 0 && (a.x - 1 < wx0 || a.y + 1 >= wy1) && seq2[a.y + 1] != '\0' && seq1[a.x - 1] == seq2[a.y + 1]) {
+				a.x--;
+				a.y++;
+				a.length++;
+			}
+		}
+		found->items[kept++] = a;
 	}
+	found->count = kept;
 	
-	list_iterator_destroy(it);
-	return leftAlignments;
+	return found;
 }
 
 /*
-* Apply alignments returned by find_alignments
+* Compare the sequences one band of tile_size rows at a time, and each band one tile at a
+* time. A tile is compared inside a window reaching `length` cells past it on every side,
+* so every run whose top cell is in the tile shows at least `length` cells in the window.
+* The tile holding a run's top cell owns it; a run cut off by the window is then extended
+* straight from the sequences, so runs crossing tiles are found once and at full length.
+* Every cell of a run is in the band of its owner or below, so once a band's tiles are done
+* its rows are final: they go to the renderer in row order, and only the runs reaching
+* further down are carried into the next band. With a length of 1 and nothing to collect,
+* the matches are sent to the renderer straight from the sequences
 */
-dotplot *apply_alignments(dotplot *dp, list_t *alignments) {
-	dotplot *filtered = zero_dotplot(dp);
-	list_node_t *node;
-	list_iterator_t *it = list_iterator_new(alignments, LIST_HEAD);
-	while ((node = list_iterator_next(it))) {
-		alignment *algn = (alignment*) node->val;
+gdImagePtr run_tiled_dotplot(char *seq1, char *seq2, int length, int tile_size, filter_pipeline *pipeline, cell_renderer *renderer, alignment_sink sink, void *arg) {
+	int width = strlen(seq1);
+	int height = strlen(seq2);
+	if (length < 1) {
+		length = 1;
+	}
+	if (tile_size < 1) {
+		tile_size = 1;
+	}
+	
+	if (length == 1 && sink == NULL && renderer != NULL) { // every match is a cell: no runs to track
+		match_kernel kernel = choose_match_kernel();
+		int words = (width + 63) / 64;
+		uint64_t *row = calloc(words > 0 ? words : 1, sizeof(uint64_t));
+		int y, w;
+		for (y = 0; y < height; y++) {
+			kernel(seq1, width, seq2[y], row);
+			for (w = 0; w < words; w++) {
+				uint64_t word = row[w];
+				while (word) {
+					int x = w * 64 + __builtin_ctzll(word);
+					word &= word - 1;
+					
+					float value = pipeline != NULL ? _pipeline_value(pipeline, 1.0, x, y) : 1.0;
+					if (value > 0) {
+						renderer->cell(renderer, x, y, value);
+					}
+				}
+			}
+		}
+		free(row);
+		return renderer->finish(renderer);
+	}
+	
+	alignment_array *active = create_alignment_array();
+	int x0, y0;
+	for (y0 = 0; y0 < height; y0 += tile_size) {
+		int y1 = y0 + tile_size < height ? y0 + tile_size : height;
+		size_t carried = active->count;
+		for (x0 = 0; x0 < width; x0 += tile_size) {
+			int x1 = x0 + tile_size < width ? x0 + tile_size : width;
+			alignment_array *found = _window_alignments(seq1, seq2, x0, y0, x1, y1, length);
+			size_t i;
+			for (i = 0; i < found->count; i++) {
+				alignment *a = &found->items[i];
+				int top_x = a->dir == UR ? a->x + a->length - 1 : a->x;
+				int top_y = _first_row(a);
+				if (top_x >= x0 && top_x < x1 && top_y >= y0 && top_y < y1) { // otherwise another tile owns it
+					_push_alignment(active, a->x, a->y, a->dir, a->length);
+				}
+			}
+			destroy_alignments(found);
+		}
 		
-		int i;
-		for (i = 0; i < algn->length; i++) {
-			point2d point = algn->points[i];
-			if (point.x >= 0 && point.y >= 0 && point.x < dp->width && point.y < dp->height) { // FIXME: shouldn't have to check this
-				filtered->cells[point.x][point.y] = 1.0;
+		size_t i;
+		if (sink != NULL) {
+			for (i = carried; i < active->count; i++) {
+				sink(&active->items[i], arg);
+			}
+		}
+		if (renderer != NULL) {
+			sparse_dotplot *band = _sparse_from_rows(width, height, active->items, active->count, y0, y1);
+			for (i = 0; i < band->count; i++) {
+				scored_cell *c = &band->cells[i];
+				float value = pipeline != NULL ? _pipeline_value(pipeline, 1.0, c->x, c->y) : 1.0;
+				if (value > 0) {
+					renderer->cell(renderer, c->x, c->y, value);
+				}
+			}
+			destroy_sparse_dotplot(band);
+		}
+		
+		size_t kept = 0;
+		for (i = 0; i < active->count; i++) { // carry the runs that reach the next band
+			if (_first_row(&active->items[i]) + active->items[i].length > y1) {
+				active->items[kept++] = active->items[i];
 			}
 		}
+		active->count = kept;
 	}
 	
-	return filtered;
+	destroy_alignments(active);
+	return renderer != NULL ? renderer->finish(renderer) : NULL;
 }
 
-void destroy_alignments(list_t *alignments) {
-	list_node_t *node;
-	list_iterator_t *it = list_iterator_new(alignments, LIST_HEAD);
-	while ((node = list_iterator_next(it))) {
-		free(node->val); // free the malloc'd points
+alignment_array *find_alignments_tiled(char *seq1, char *seq2, int length, int tile_size) {
+	alignment_array *alignments = create_alignment_array();
+	run_tiled_dotplot(seq1, seq2, length, tile_size, NULL, NULL, collect_alignment, alignments);
+	sort_runs(alignments->items, alignments->count, strlen(seq1));
+	return alignments;
+}
+
+void collect_alignment(alignment *algn, void *alignments) {
+	_push_alignment(alignments, algn->x, algn->y, algn->dir, algn->length);
+}
+
+/* Viewport stuff */
+alignment_array *find_alignments_viewport(char *seq1, char *seq2, viewport view, int length) {
+	view = _clip_viewport(seq1, seq2, view);
+	alignment_array *alignments = _window_alignments(seq1, seq2, view.x0, view.y0, view.x1, view.y1, length > 1 ? length : 1);
+	
+	size_t i;
+	for (i = 0; i < alignments->count; i++) { // sort in the scan order of the window
+		alignments->items[i].x -= view.x0;
+		alignments->items[i].y -= view.y0;
 	}
-	list_iterator_destroy(it);
-	list_destroy(alignments);
+	sort_runs(alignments->items, alignments->count, view.x1 - view.x0);
+	for (i = 0; i < alignments->count; i++) {
+		alignments->items[i].x += view.x0;
+		alignments->items[i].y += view.y0;
+	}
+	
+	return alignments;
 }
 
+/* Sparse dotplot stuff */
 /*
-* Print alignments list as JSON of the format
-* [
-*   {
-*     "sequence": "ACTG",
-*     "position": {
-*       "x": 1,
-*       "y": 1
-*     }
-*   }
-* ]
+* Collect the matches of a dotplot that have a score other than 0, in row order
 */
-void print_alignments(list_t *alignments, char *seq1, char *seq2) {
-	list_node_t *node;
-	list_iterator_t *it = list_iterator_new(alignments, LIST_HEAD);
+sparse_dotplot *create_sparse_dotplot(dotplot *dp) {
+	size_t words = dp->stride * (size_t) dp->height;
+	size_t w, count = 0;
+	for (w = 0; w < words; w++) {
+		count += __builtin_popcountll(dp->bits[w]);
+	}
 	
-	printf("[");
-	int j = 0;
-	while ((node = list_iterator_next(it))) {
-		alignment *algn = (alignment*) node->val;
-		
-		if (j > 0) {
-			printf(",");
-		}
-		printf("{\"sequence\":");
-		int seq1len = strlen(seq1);
-		int seq2len = strlen(seq2);
-		int start_x = -1;
-		int start_y = -1;
-		
-		printf("\"");
-		int i;
-		for (i = 0; i < algn->length; i++) {
-			point2d point = algn->points[i];
-			int x = point.x;
-			int y = point.y;
-			
-			if (start_x < 0) {
-				start_x = x;
-				start_y = y;
+	sparse_dotplot *sp = _sparse_allocate(dp->width, dp->height, count);
+	float epsilon = 0.00001;
+	count = 0;
+	int y;
+	for (y = 0; y < dp->height; y++) {
+		uint64_t *row = dp->bits + (size_t) y * dp->stride;
+		for (w = 0; w < dp->stride; w++) {
+			uint64_t word = row[w];
+			while (word) {
+				int x = (int) (w * 64) + __builtin_ctzll(word);
+				word &= word - 1;
+				
+				float value = get_value(dp, x, y);
+				if (value >= epsilon || value <= -epsilon) { // like set_value, cells at 0 are gone
+					scored_cell c = {x, y, value};
+					sp->cells[count++] = c;
+				}
 			}
-			
-			char seq1base = seq1[x+1];
-			char seq2base = seq2[y+1];
-			printf("%c", seq1base);
 		}
-		printf("\",");
-		printf("\"position\": {\"x\": %d, \"y\": %d}", start_x, start_y);
-		printf("}");
-		j++;
 	}
-	printf("]");
+	sp->count = count;
 	
-	list_iterator_destroy(it);
+	return sp;
 }
 
-dotplot *apply_filter(dotplot *dp, filter *f) {
-	int dp_max_x = dp->width;
-	int dp_max_y = dp->height;
-	int f_max_x = f->width;
-	int f_max_y = f->height;
+/*
+* Same as create_sparse_dotplot(create_dotplot_from_alignments(width, height, alignments)),
+* without the dotplot
+*/
+sparse_dotplot *create_sparse_dotplot_from_alignments(int width, int height, alignment_array *alignments) {
+	return _sparse_from_alignments(width, height, alignments);
+}
+
+void destroy_sparse_dotplot(sparse_dotplot *sp) {
+	free(sp->cells);
+	free(sp);
+}
+
+/*
+* Same as apply_filter for a sparse dotplot: only the listed cells are scored and cells
+* brought down to 0 are dropped, so the result stays sparse
+*/
+sparse_dotplot *apply_filter_sparse(sparse_dotplot *sp, filter *f) {
+	sparse_dotplot *filtered = _sparse_allocate(sp->width, sp->height, sp->count);
+	memcpy(filtered->cells, sp->cells, sp->count * sizeof(scored_cell));
 	
-	dotplot *filtered = clone_dotplot(dp);
-	/* The maximums are the maximum number of elements to iterate over and will always be the smaller number */
-	int max_x = dp_max_x < f_max_x ? dp_max_x : f_max_x;
-	int max_y = dp_max_y < f_max_y ? dp_max_y : f_max_y;
+	sparse_filter_job job = {
+		.filtered = filtered,
+		.f = f,
+		.tasks = _task_count_sized(sp->count)
+	};
+	pool_run(thread_count, job.tasks, _filter_cells, &job);
 	
-	int x, y;
-	for (x = 0; x < max_x; x++) {
-		for (y = 0; y < max_y; y++) {
-			set_value(filtered, x, y, f->cells[x][y]); // this will only set the value if there is a match
+	float epsilon = 0.00001;
+	size_t i, count = 0;
+	for (i = 0; i < filtered->count; i++) {
+		float value = filtered->cells[i].value;
+		if (value >= epsilon || value <= -epsilon) {
+			filtered->cells[count++] = filtered->cells[i];
 		}
 	}
+	filtered->count = count;
 	
 	return filtered;
 }
 
-dotplot *apply_filter_safe(dotplot *dp, filter *f) {
-	if (dp->width != f->width || dp->height != f->height) {
-		return NULL;
+/*
+* Hand the cells of a sparse dotplot with a positive score to a renderer
+*/
+gdImagePtr render_sparse_dotplot(sparse_dotplot *sp, cell_renderer *renderer) {
+	size_t i;
+	for (i = 0; i < sp->count; i++) {
+		scored_cell *c = &sp->cells[i];
+		if (c->value > 0) {
+			renderer->cell(renderer, c->x, c->y, c->value);
+		}
 	}
 	
-	return apply_filter(dp, f);
+	return renderer->finish(renderer);
 }
 
 void print_dotplot(dotplot *dp) {
 	int y, x;
 	for (y = 0; y < dp->height; y++) {
 		for (x = 0; x < dp->width; x++) {
-			float cell = dp->cells[x][y];
+			float cell = get_value(dp, x, y);
 			printf("%g", cell);
 		}
 		printf("\n");
@@ -641,16 +2097,33 @@ void print_dotplot(dotplot *dp) {
 }
 
 int set_value(dotplot *dp, int x, int y, float value) {
-	float cell = dp->cells[x][y];
+	float cell = get_value(dp, x, y);
 	float epsilon = 0.00001;
-	if (abs(cell) < epsilon) { // Effectively compare to 0
+	if (cell < epsilon && cell > -epsilon) { // Effectively compare to 0
 		return 0; // failed; no match
 	}
 	
-	dp->cells[x][y] = value;
+	_dotplot_scores(dp)[(size_t) y * dp->width + x] = value;
 	return 1;
 }
 
+void set_thread_count(int threads) {
+	thread_count = threads > 0 ? threads : 1;
+	set_inflate_threads(thread_count);
+}
+
+int get_thread_count(void) {
+	return thread_count;
+}
+
+float get_value(dotplot *dp, int x, int y) {
+	if (x < 0 || y < 0 || x >= dp->width || y >= dp->height || !_is_set(dp, x, y)) {
+		return 0.0;
+	}
+	
+	return dp->scores == NULL ? 1.0 : dp->scores[(size_t) y * dp->width + x];
+}
+
 gdImagePtr render_dotplot(dotplot *dp, int width, int height) {
 	/* don't scale up */
 	if (width > dp->width) {
@@ -676,94 +2149,334 @@ gdImagePtr render_dotplot(dotplot *dp, int width, int height) {
 	gdImagePtr image = gdImageCreate(width, height);
 	int background_color = gdImageColorAllocate(image, 255, 255, 255);
 	int match_color = gdImageColorAllocate(image, 0, 0, 0); // black
-	int region_color = gdImageColorAllocate(image, 47, 47, 203); // blue
+	region_index *regions = compile_regions(dp);
+	int *region_colors = regions != NULL ? _region_colors(image, regions) : NULL;
 	
-	int x, y;
+	int y;
+	size_t w;
 	double pixel_x = 0.0;
 	double pixel_y = 0.0;
 	for (y = 0; y < dp->height; y++) {
-		pixel_x = 0;
-		for (x = 0; x < dp->width; x++) {
-			// in the advanced version of the dotplot, matches are continuous values
-			if (dp->cells[x][y] > 0) { // match
-				int color;
+		uint64_t *row = dp->bits + (size_t) y * dp->stride;
+		for (w = 0; w < dp->stride; w++) {
+			uint64_t word = row[w];
+			while (word) { // only visit matches
+				int x = (int) (w * 64) + __builtin_ctzll(word);
+				word &= word - 1;
 				
-				color = match_color;
-				gdImageFilledRectangle(image, pixel_x, pixel_y, pixel_x + render_width, pixel_y + render_height, color);
+				// in the advanced version of the dotplot, matches are continuous values
+				if (dp->scores == NULL || dp->scores[(size_t) y * dp->width + x] > 0) { // match
+					int color = match_color;
+					if (regions != NULL) {
+						int r = region_at(regions, x, y);
+						if (r >= 0) {
+							color = region_colors[r];
+						}
+					}
+					
+					pixel_x = x * cell_width;
+					gdImageFilledRectangle(image, pixel_x, pixel_y, pixel_x + render_width, pixel_y + render_height, color);
+				}
 			}
-			
-			pixel_x += cell_width;
 		}
 		
 		pixel_y += cell_height;
 	}
 	
+	free(region_colors);
+	destroy_region_index(regions);
 	return image;
 }
 
-//TODO: Paint region backgrounds in a different color
 gdImagePtr render_dotplot_continuous(dotplot *dp, color_chooser *cc, int width, int height) {
-	/* don't scale up */
-	if (width > dp->width) {
-		width = dp->width;
+	cell_renderer *renderer = create_continuous_renderer(cc, dp->width, dp->height, width, height);
+	continuous_renderer *state = renderer->state;
+	region_index *regions = compile_regions(dp);
+	if (regions != NULL) { // matches in a region take its color
+		state->regions = regions;
+		state->region_colors = _region_colors(state->image, regions);
 	}
-	if (height > dp->height) {
-		height = dp->height;
+	int y;
+	size_t w;
+	for (y = 0; y < dp->height; y++) {
+		uint64_t *row = dp->bits + (size_t) y * dp->stride;
+		for (w = 0; w < dp->stride; w++) {
+			uint64_t word = row[w];
+			while (word) { // only visit matches
+				int x = (int) (w * 64) + __builtin_ctzll(word);
+				word &= word - 1;
+				
+				// in the advanced version of the dotplot, matches are continuous values
+				float value = dp->scores == NULL ? 1.0 : dp->scores[(size_t) y * dp->width + x];
+				if (value > 0) { // match
+					renderer->cell(renderer, x, y, value);
+				}
+			}
+		}
 	}
 	
-	double min_width = 1.0;
-	double min_height = 1.0;
-	double cell_width = (double) width / (double) dp->width;
-	double cell_height = (double) height / (double) dp->height;
-	double render_width = cell_width;
-	double render_height = cell_height;
-	if (render_width < min_width) {
-		render_width = min_width;
+	gdImagePtr image = renderer->finish(renderer);
+	destroy_region_index(regions);
+	return image;
+}
+
+cell_renderer *create_continuous_renderer(color_chooser *cc, int plot_width, int plot_height, int width, int height) {
+	/* don't scale up */
+	if (width > plot_width) {
+		width = plot_width;
 	}
-	if (render_height < min_height) {
-		render_height = min_height;
+	if (height > plot_height) {
+		height = plot_height;
 	}
 	
+	continuous_renderer *state = malloc(sizeof(continuous_renderer));
+	state->table = compile_color_chooser(cc);
+	state->cell_width = (double) width / (double) plot_width;
+	state->cell_height = (double) height / (double) plot_height;
+	state->render_width = state->cell_width < 1.0 ? 1.0 : state->cell_width;
+	state->render_height = state->cell_height < 1.0 ? 1.0 : state->cell_height;
+	
 	gdImagePtr image = gdImageCreate(width, height);
-	/* allocate all colors */
-	int background_color = gdImageColorAllocate(image, 255, 255, 255);
-	int i;
-	list_t *color_list = cc->ranges;
-	int colorArray[color_list->len+1];
-	for (i = 0; i < color_list->len; i++) {
-		list_node_t *cnode = list_at(color_list, i);
-		color *c = (color*) cnode->val;
-		
-		colorArray[i] = gdImageColorAllocate(image, c->blue, c->blue, c->blue); //FIXME
+	state->image = image;
+	state->colors = _allocate_colors(image, state->table);
+	state->regions = NULL;
+	state->region_colors = NULL;
+	
+	cell_renderer *renderer = malloc(sizeof(cell_renderer));
+	renderer->cell = _continuous_cell;
+	renderer->finish = _continuous_finish;
+	renderer->state = state;
+	return renderer;
+}
+
+/*
+* A renderer that bins cells into the pixels they fall in and reduces each pixel to one value
+* before touching the image, so the cost per cell is a buffer update instead of a gd call.
+* Values map to colors through cc, or to shades of gray when cc is NULL
+*/
+cell_renderer *create_binned_renderer(color_chooser *cc, pixel_reducer reducer, int plot_width, int plot_height, int width, int height) {
+	/* don't scale up */
+	if (width > plot_width) {
+		width = plot_width;
+	}
+	if (height > plot_height) {
+		height = plot_height;
 	}
-	color default_color = cc->default_color;
-	colorArray[i+1] = gdImageColorAllocate(image, default_color.red, default_color.blue, default_color.green);
 	
-	int x, y;
-	double pixel_x = 0.0;
-	double pixel_y = 0.0;
-	for (y = 0; y < dp->height; y++) {
-		pixel_x = 0;
-		for (x = 0; x < dp->width; x++) {
-			// in the advanced version of the dotplot, matches are continuous values
-			float value = dp->cells[x][y];
-			if (value > 0) { // match
-				int cindex = _color_index(cc, value);
-				gdImageFilledRectangle(image, pixel_x, pixel_y, pixel_x + render_width, pixel_y + render_height, colorArray[cindex]);
-			}
-			
-			pixel_x += cell_width;
+	binned_renderer *state = malloc(sizeof(binned_renderer));
+	size_t pixels = (size_t) width * height;
+	state->table = cc != NULL ? compile_color_chooser(cc) : NULL;
+	state->reducer = reducer;
+	state->plot_width = plot_width;
+	state->plot_height = plot_height;
+	state->width = width;
+	state->height = height;
+	state->cell_width = (double) width / (double) plot_width;
+	state->cell_height = (double) height / (double) plot_height;
+	state->values = reducer != REDUCE_DENSITY ? calloc(pixels > 0 ? pixels : 1, sizeof(float)) : NULL;
+	state->counts = reducer == REDUCE_MEAN || reducer == REDUCE_DENSITY ? calloc(pixels > 0 ? pixels : 1, sizeof(uint32_t)) : NULL;
+	
+	cell_renderer *renderer = malloc(sizeof(cell_renderer));
+	renderer->cell = _binned_cell;
+	renderer->finish = _binned_finish;
+	renderer->state = state;
+	return renderer;
+}
+
+/*
+* Same image as create_binned_renderer, written straight to a PNG file in bands of
+* PNG_BAND_ROWS pixel rows. Only one band of pixels exists at a time, so memory follows the
+* width of the image rather than its area. Cells must come in row order. finish returns NULL
+* and sets *written to 1 or 0 depending on whether or not the file was written
+*/
+cell_renderer *create_png_renderer(color_chooser *cc, pixel_reducer reducer, int plot_width, int plot_height, int width, int height, char *filename, int *written) {
+	/* don't scale up */
+	if (width > plot_width) {
+		width = plot_width;
+	}
+	if (height > plot_height) {
+		height = plot_height;
+	}
+	
+	png_renderer *state = malloc(sizeof(png_renderer));
+	state->table = cc != NULL ? compile_color_chooser(cc) : NULL;
+	uint8_t palette[3 * PALETTE_SIZE];
+	int colors = _palette(state->table, palette);
+	state->png = open_png_stream(filename, width, height, palette, colors);
+	if (state->png == NULL) {
+		if (state->table != NULL) {
+			destroy_color_table(state->table);
+		}
+		free(state);
+		return NULL;
+	}
+	
+	size_t band_pixels = (size_t) PNG_BAND_ROWS * (width > 0 ? width : 1);
+	state->reducer = reducer;
+	state->plot_width = plot_width;
+	state->plot_height = plot_height;
+	state->width = width;
+	state->height = height;
+	state->cell_width = (double) width / (double) plot_width;
+	state->cell_height = (double) height / (double) plot_height;
+	state->band = 0;
+	memset(state->touched, 0, PNG_BAND_ROWS);
+	state->values = reducer != REDUCE_DENSITY ? calloc(band_pixels, sizeof(float)) : NULL;
+	state->counts = reducer == REDUCE_MEAN || reducer == REDUCE_DENSITY ? calloc(band_pixels, sizeof(uint32_t)) : NULL;
+	state->columns = NULL;
+	state->rows = NULL;
+	if (reducer == REDUCE_DENSITY) {
+		state->columns = _cells_per_pixel(plot_width, width, state->cell_width);
+		state->rows = _cells_per_pixel(plot_height, height, state->cell_height);
+	}
+	state->line = malloc(width > 0 ? width : 1);
+	state->written = written;
+	*written = 0;
+	
+	cell_renderer *renderer = malloc(sizeof(cell_renderer));
+	renderer->cell = _png_cell;
+	renderer->finish = _png_finish;
+	renderer->state = state;
+	return renderer;
+}
+
+#ifdef __unix__
+/*
+* A renderer that writes a Deep Zoom style pyramid of tile_size square PNG tiles into
+* directory, as <level>/<column>_<row>.png. The last level has one pixel per cell and each
+* level above is downsampled from the one below with the reducer, so the match data is only
+* computed once. Empty tiles are skipped and directory/tiles.json lists the tiles written.
+* finish returns the overview (the largest level that fits in one tile), or NULL if the
+* pyramid couldn't be written
+*/
+cell_renderer *create_tile_renderer(color_chooser *cc, pixel_reducer reducer, int plot_width, int plot_height, char *directory, int tile_size) {
+	char path[PATH_MAX];
+	mkdir(directory, 0755);
+	snprintf(path, sizeof(path), "%s/tiles.json", directory);
+	FILE *manifest_file = fopen(path, "w");
+	if (manifest_file == NULL) {
+		return NULL;
+	}
+	
+	tile_renderer *state = malloc(sizeof(tile_renderer));
+	state->directory = strdup(directory);
+	state->table = cc != NULL ? compile_color_chooser(cc) : NULL;
+	state->reducer = reducer;
+	state->plot_width = plot_width;
+	state->plot_height = plot_height;
+	state->tile_size = tile_size;
+	state->image = NULL;
+	state->failed = 0;
+	
+	int longest = plot_width > plot_height ? plot_width : plot_height;
+	state->levels = 1;
+	while (((int64_t) 1 << (state->levels - 1)) < longest) {
+		state->levels++;
+	}
+	
+	state->level = malloc(state->levels * sizeof(tile_level));
+	state->overview = 0;
+	int l;
+	for (l = 0; l < state->levels; l++) {
+		tile_level *level = &state->level[l];
+		int64_t scale = (int64_t) 1 << (state->levels - 1 - l);
+		level->width = (plot_width + scale - 1) / scale;
+		level->height = (plot_height + scale - 1) / scale;
+		level->columns = (level->width + tile_size - 1) / tile_size;
+		level->rows = (level->height + tile_size - 1) / tile_size;
+		level->row = 0;
+		level->tiles = calloc(level->columns > 0 ? level->columns : 1, sizeof(tile*));
+		level->filled = malloc((level->columns > 0 ? level->columns : 1) * sizeof(int));
+		level->filled_count = 0;
+		if (level->columns <= 1 && level->rows <= 1) {
+			state->overview = l;
 		}
 		
-		pixel_y += cell_height;
+		snprintf(path, sizeof(path), "%s/%d", directory, l);
+		mkdir(path, 0755);
 	}
 	
-	return image;
+	state->manifest_file = manifest_file;
+	state->manifest = create_json_writer(manifest_file, JSON_COMPACT);
+	json_begin_object(state->manifest);
+	json_key(state->manifest, "width");
+	json_int(state->manifest, plot_width);
+	json_key(state->manifest, "height");
+	json_int(state->manifest, plot_height);
+	json_key(state->manifest, "tile_size");
+	json_int(state->manifest, tile_size);
+	json_key(state->manifest, "levels");
+	json_int(state->manifest, state->levels);
+	json_key(state->manifest, "format");
+	json_string(state->manifest, "png", 3);
+	json_key(state->manifest, "tiles"); // [level, column, row] of each tile written
+	json_begin_array(state->manifest);
+	
+	cell_renderer *renderer = malloc(sizeof(cell_renderer));
+	renderer->cell = _tile_cell;
+	renderer->finish = _tile_finish;
+	renderer->state = state;
+	return renderer;
+}
+#endif
+
+int write_image(gdImagePtr image, char *filename) {
+	FILE *out = fopen(filename, "wb");
+	if (!out) {
+		return 0;
+	}
+	gdImagePng(image, out);
+	fclose(out);
+	return 1;
 }
 
 list_node_t *add_region(dotplot *dp, region r) {
-	list_t *regions = dp->regions;
-	return list_rpush(regions, (list_node_t*) &r);
+	region *copy = malloc(sizeof(region));
+	*copy = r;
+	return list_rpush(dp->regions, list_node_new(copy));
+}
+
+region_index *compile_regions(dotplot *dp) {
+	if (dp->regions->len == 0) {
+		return NULL;
+	}
+	
+	region_index *index = malloc(sizeof(region_index));
+	index->count = 0;
+	index->regions = malloc(dp->regions->len * sizeof(region));
+	list_iterator_t *iter = list_iterator_new(dp->regions, LIST_HEAD);
+	list_node_t *node;
+	while ((node = list_iterator_next(iter)) != NULL) {
+		index->regions[index->count++] = *(region*) node->val;
+	}
+	list_iterator_destroy(iter);
+	
+	_compile_axis(&index->axes[X], index->regions, index->count, X);
+	_compile_axis(&index->axes[Y], index->regions, index->count, Y);
+	return index;
+}
+
+int region_at(region_index *index, int x, int y) {
+	int rx = _axis_region(&index->axes[X], x);
+	int ry = _axis_region(&index->axes[Y], y);
+	if (rx < 0 || (ry >= 0 && ry < rx)) { // the region added first wins
+		return ry;
+	}
+	
+	return rx;
+}
+
+void destroy_region_index(region_index *index) {
+	if (index == NULL) {
+		return;
+	}
+	
+	free(index->axes[X].starts);
+	free(index->axes[X].regions);
+	free(index->axes[Y].starts);
+	free(index->axes[Y].regions);
+	free(index->regions);
+	free(index);
 }
 
 /* Filter stuff */
@@ -780,29 +2493,48 @@ filter *create_filter(int width, int height, float **vals) {
 	return f;
 }
 
+filter *create_separable_filter(int width, int height, float *x_values, float *y_values) {
+	float *xs = malloc((width > 0 ? width : 1) * sizeof(float));
+	float *ys = malloc((height > 0 ? height : 1) * sizeof(float));
+	memcpy(xs, x_values, width * sizeof(float));
+	memcpy(ys, y_values, height * sizeof(float));
+	
+	return _separable_filter_wrap(width, height, xs, ys);
+}
 
 #ifdef __unix__
 filter *create_filter_from_values(char *file1, char *file2) {
+	return load_filter(file1, file2, 0, NULL);
+}
+
+filter *load_filter(char *file1, char *file2, int cached, value_error *error) {
 	int width, height;
-	float *vals1 = _read_val_list(file1, &width);
-	float *vals2 = _read_val_list(file2, &height);
-	
-	array2d *array = _create_avg_array(width, height, vals1, vals2);
-	free(vals1);
-	free(vals2);
+	float *vals1 = cached ? read_values_cached(file1, &width, error) : read_values(file1, &width, error);
+	if (vals1 == NULL) {
+		return NULL;
+	}
+	float *vals2 = cached ? read_values_cached(file2, &height, error) : read_values(file2, &height, error);
+	if (vals2 == NULL) {
+		free(vals1);
+		return NULL;
+	}
 	
-	return create_filter(width, height, array->vals);
+	return _separable_filter_wrap(width, height, vals1, vals2);
 }
 #endif
 
 void destroy_filter(filter *f)  {
 	float **cells = f->cells;
 	int x;
-	for (x = 0; x < f->width; x++) {
-		free(cells[x]);
+	if (cells != NULL) {
+		for (x = 0; x < f->width; x++) {
+			free(cells[x]);
+		}
 	}
 	
 	free(cells);
+	free(f->x_values);
+	free(f->y_values);
 	free(f);
 }
 
@@ -821,7 +2553,7 @@ void destroy_color_chooser(color_chooser *cc) {
 }
 
 int add_color(color_chooser *cc, float start, float end, color c) {
-	if (start < 0 || end > 1) {
+	if (start < 0 || end > 1 || cc->ranges->len >= COLOR_CHOOSER_MAX_RANGES) {
 		return 0; // failed
 	}
 	
@@ -835,13 +2567,13 @@ int add_color(color_chooser *cc, float start, float end, color c) {
 }
 
 color color_for(color_chooser *cc, float value) {
-	int i = 0;
 	list_iterator_t *li = list_iterator_new(cc->ranges, LIST_HEAD);
 	list_node_t *cnode = NULL;
 	color_range *cr = NULL;
 	while ((cnode = list_iterator_next(li)) != NULL) {
 		cr = cnode->val;
 		if (cr->start <= value && cr->end >= value) {
+			list_iterator_destroy(li);
 			return cr->color;
 		}
 	}
@@ -849,3 +2581,74 @@ color color_for(color_chooser *cc, float value) {
 	list_iterator_destroy(li);
 	return cc->default_color;
 }
+
+/*
+* Flatten the ranges of a color chooser into arrays plus a table over COLOR_TABLE_BINS
+* equal bins of [0, 1). A bin holds the range every value in it resolves to, or -1 when a
+* range starts or ends inside it and the ranges have to be checked
+*/
+color_table *compile_color_chooser(color_chooser *cc) {
+	color_table *table = malloc(sizeof(color_table));
+	int count = cc->ranges->len;
+	if (count > COLOR_CHOOSER_MAX_RANGES) { // only possible by pushing onto the list directly
+		count = COLOR_CHOOSER_MAX_RANGES;
+	}
+	table->count = count;
+	table->starts = malloc((count > 0 ? count : 1) * sizeof(float));
+	table->ends = malloc((count > 0 ? count : 1) * sizeof(float));
+	table->colors = malloc((count + 1) * sizeof(color));
+	
+	list_iterator_t *li = list_iterator_new(cc->ranges, LIST_HEAD);
+	list_node_t *cnode = NULL;
+	int i = 0;
+	while ((cnode = list_iterator_next(li)) != NULL && i < count) {
+		color_range *cr = cnode->val;
+		table->starts[i] = cr->start;
+		table->ends[i] = cr->end;
+		table->colors[i] = cr->color;
+		i++;
+	}
+	list_iterator_destroy(li);
+	table->colors[count] = cc->default_color;
+	
+	int bin;
+	for (bin = 0; bin < COLOR_TABLE_BINS; bin++) {
+		double low = (double) bin / COLOR_TABLE_BINS;
+		double high = (double) (bin + 1) / COLOR_TABLE_BINS; // not part of the bin
+		int index = count;
+		for (i = 0; i < count; i++) {
+			if (table->starts[i] <= low && table->ends[i] >= high) { // covers the whole bin
+				index = i;
+				break;
+			}
+			if (table->ends[i] >= low && table->starts[i] < high) { // covers part of it
+				index = -1;
+				break;
+			}
+		}
+		table->index[bin] = index;
+	}
+	
+	return table;
+}
+
+/*
+* Resolve a value the table can't answer from its bins, the same way color_for does
+*/
+int color_table_search(color_table *table, float value) {
+	int i;
+	for (i = 0; i < table->count; i++) {
+		if (table->starts[i] <= value && table->ends[i] >= value) {
+			return i;
+		}
+	}
+	
+	return table->count;
+}
+
+void destroy_color_table(color_table *table) {
+	free(table->starts);
+	free(table->ends);
+	free(table->colors);
+	free(table);
+}
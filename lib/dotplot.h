@@ -1,5 +1,13 @@
 #include "list/src/list.h"
+#include "alignfile.h"
+#include "fasta.h"
+#include "json.h"
+#include "packed.h"
+#include "run.h"
+#include "suffix.h"
+#include "values.h"
 #include <stddef.h>
+#include <stdint.h>
 #include <gd.h>
 
 /*
@@ -29,59 +37,256 @@ typedef struct {
 	color *color;
 } region;
 
+/*
+* The regions of a dotplot compiled for rendering. Each axis is cut into sorted segments
+* that hold the first region (in the order they were added) covering them, so finding the
+* region of a cell is a binary search per axis instead of a walk over every region
+*/
+typedef struct {
+	int count;
+	int *starts;  // first position of each segment, ascending
+	int *regions; // region covering each segment, -1 for none
+} region_axis;
+
+typedef struct {
+	int count;
+	region *regions;     // copies, in the order they were added
+	region_axis axes[2]; // indexed by axis_t
+} region_index;
+
+/*
+* Rendered images draw from a palette of 256 entries: the background, one per range and the
+* default color, so a color chooser holds at most COLOR_CHOOSER_MAX_RANGES ranges
+*/
+#define COLOR_CHOOSER_MAX_RANGES 254
+
 typedef struct {
 	list_t *ranges;
 	color default_color;
 } color_chooser;
 
 /*
-* a struct that can be applied to a dotplot as a filter
+* A color chooser compiled for rendering. Most values resolve to their range with a single
+* load from `index`; only values in a bin that a range boundary cuts through search the
+* ranges. Range i has colors[i]; colors[count] is the default color
+*/
+#define COLOR_TABLE_BINS 4096
+
+typedef struct {
+	int count;
+	float *starts;
+	float *ends;
+	color *colors;
+	int16_t index[COLOR_TABLE_BINS]; // range for every value of a bin of [0, 1), -1 to search
+} color_table;
+
+/*
+* a struct that can be applied to a dotplot as a filter. A separable filter has no cells:
+* the value of (x, y) is the mean of x_values[x] and y_values[y]
 */
 typedef struct {
 	int width;
 	int height;
-	float **cells;
+	float **cells; // NULL for a separable filter
+	float *x_values;
+	float *y_values;
 } filter;
 
+/*
+* Matches are kept in a contiguous bit-packed matrix with one row per position in the
+* second sequence (bit x of row y is set when seq1[x] == seq2[y]). Scores only exist
+* once a filter has been applied; until then every match has an implicit value of 1.0
+*/
 typedef struct {
 	int width;
 	int height;
-	float **cells;
+	size_t stride; // number of 64-bit words in a row of the match matrix
+	uint64_t *bits;
+	float *scores; // row-major score plane, NULL until a filter is applied
 	list_t *regions;
 } dotplot;
 
+/*
+* A window on the plot of two sequences: columns x0 up to x1 and rows y0 up to y1, ends
+* exclusive, in the coordinates of the whole sequences
+*/
+typedef struct {
+	int x0;
+	int y0;
+	int x1;
+	int y1;
+} viewport;
+
+/*
+* Receives the scored cells of a dotplot one at a time, in row order, and turns them into
+* an image. finish returns the image and frees the renderer
+*/
+typedef struct cell_renderer {
+	void (*cell)(struct cell_renderer *renderer, int x, int y, float value);
+	gdImagePtr (*finish)(struct cell_renderer *renderer);
+	void *state;
+} cell_renderer;
+
+/*
+* How a binned renderer turns the cells that fall in one pixel into one value
+*/
+typedef enum {
+	REDUCE_ANY,    // 1 when any cell is set
+	REDUCE_MAX,    // highest value
+	REDUCE_MEAN,   // mean value of the cells that are set
+	REDUCE_DENSITY // fraction of the cells of the pixel that are set
+} pixel_reducer;
+
+/*
+* An ungapped alignment: the cell with the lowest x, a length and a direction (UR when y
+* shrinks as x grows, LR when both grow)
+*/
+typedef run alignment;
+
+/*
+* Alignments are returned as one contiguous, growable array
+*/
+typedef struct {
+	alignment *items;
+	size_t count;
+	size_t capacity;
+} alignment_array;
+
+/*
+* Any number of filter rounds applied to the matches of a dotplot in one pass. Each round
+* scores the cells that are still above 0, the same as chaining apply_filter calls, and the
+* final values go straight to a renderer without building intermediate dotplots
+*/
+typedef struct {
+	int width;
+	int height;
+	filter **rounds;
+	int count;
+	int capacity;
+	alignment_array *mask; // when set, only cells of these alignments are scored
+} filter_pipeline;
+
+/*
+* Receives alignments one at a time as a tiled comparison finds them
+*/
+typedef void (*alignment_sink)(alignment *algn, void *arg);
+
+/*
+* The matches of a dotplot as a list of scored cells in row order (by y, then x). Filtering
+* and rendering a sparse dotplot cost O(matches) instead of O(width * height)
+*/
+typedef struct {
+	int x;
+	int y;
+	float value;
+} scored_cell;
+
+typedef struct {
+	int width;
+	int height;
+	scored_cell *cells;
+	size_t count;
+} sparse_dotplot;
+
 /* Operations on dotplots */
 dotplot *create_dotplot(char *seq1, char *seq2);
+dotplot *create_dotplot_packed(packed_sequence *seq1, packed_sequence *seq2);
+dotplot *create_dotplot_viewport(char *seq1, char *seq2, viewport view); // only the window, cell (x, y) is (view.x0 + x, view.y0 + y)
 #ifdef __unix__
 	/* These functions rely on sys/stat.h to get the filesize which is only guaranteed to exist on *nix platforms */
-	dotplot *create_dotplot_from_fasta(char *file1, char *file2);
+	dotplot *create_dotplot_from_fasta(char *file1, char *file2); // first record of each file
 	dotplot *filter_dotplot_to_matrix(dotplot *dp, char *matrixFile);
 #endif
 dotplot *zero_dotplot(dotplot *dp);
 dotplot *clone_dotplot(dotplot *dp);
 void destroy_dotplot(dotplot *dp);
-list_t *find_alignments(dotplot *dp, int length);
-dotplot *apply_alignments(dotplot *dp, list_t *alignments);
-void destroy_alignments(list_t *alignments);
-void print_alignments(list_t *alignments, char *seq1, char *seq2);
+alignment_array *find_alignments(dotplot *dp, int length);
+alignment_array *find_alignments_scalar(dotplot *dp, int length); // cell-at-a-time reference for find_alignments
+alignment_array *find_alignments_from_sequences(char *seq1, char *seq2, int length); // never materializes the dotplot
+alignment_array *find_alignments_packed(packed_sequence *seq1, packed_sequence *seq2, int length);
+alignment_array *find_alignments_kmer(char *seq1, char *seq2, int length); // seeded from k-mer hits, for longer minimum lengths
+alignment_array *find_alignments_indexed(suffix_index *index, char *seq2, int length); // index built over seq1
+alignment_array *find_alignments_viewport(char *seq1, char *seq2, viewport view, int length); // runs crossing the window, at full length and in whole-sequence coordinates
+dotplot *apply_alignments(dotplot *dp, alignment_array *alignments);
+dotplot *create_dotplot_from_alignments(int width, int height, alignment_array *alignments);
+alignment_array *create_alignment_array();
+void destroy_alignments(alignment_array *alignments);
+list_t *alignments_as_list(alignment_array *alignments); // nodes point into the array
+void print_alignments(alignment_array *alignments, char *seq1, char *seq2);
+int write_alignments(json_writer *writer, alignment_array *alignments, char *seq1); // same JSON, through a buffered writer
+int write_alignments_binary(alignment_array *alignments, int width, int height, char *filename, int compress); // returns 1 on success
+#ifdef __unix__
+	alignment_array *read_alignments_binary(char *filename); // sorted by diagonal, NULL if the file can't be read
+#endif
 dotplot *apply_filter(dotplot *dp, filter *f);
 dotplot *apply_filter_safe(dotplot *dp, filter *f); // same as above but asserts equal dimensions
 int write_image(gdImagePtr image, char *filename);
 void print_dotplot(dotplot *dp);
 int set_value(dotplot *dp, int x, int y, float value);
+float get_value(dotplot *dp, int x, int y);
 gdImagePtr render_dotplot(dotplot *dp, int width, int height);
 gdImagePtr render_dotplot_continuous(dotplot *dp, color_chooser *cc, int width, int height);
+cell_renderer *create_continuous_renderer(color_chooser *cc, int plot_width, int plot_height, int width, int height);
+cell_renderer *create_binned_renderer(color_chooser *cc, pixel_reducer reducer, int plot_width, int plot_height, int width, int height); // cc may be NULL
+cell_renderer *create_png_renderer(color_chooser *cc, pixel_reducer reducer, int plot_width, int plot_height, int width, int height, char *filename, int *written); // NULL if filename can't be created
+#ifdef __unix__
+	/* Writes a tile pyramid into directory and returns the overview image. NULL if directory can't be written */
+	cell_renderer *create_tile_renderer(color_chooser *cc, pixel_reducer reducer, int plot_width, int plot_height, char *directory, int tile_size);
+#endif
 list_node_t *add_region(dotplot *dp, region r);
+region_index *compile_regions(dotplot *dp); // NULL when dp has no regions
+int region_at(region_index *index, int x, int y); // index of the region holding (x, y), -1 for none
+void destroy_region_index(region_index *index);
+
+/* Threading (defaults to a single thread) */
+void set_thread_count(int threads);
+int get_thread_count(void);
 
 /* Operations on filters */
 filter *create_filter(int width, int height, float **vals);
+filter *create_separable_filter(int width, int height, float *x_values, float *y_values);
 #ifdef __unix__
 	filter *create_filter_from_values(char *ppfile1, char *ppfile2);
+	filter *load_filter(char *file1, char *file2, int cached, value_error *error); // reports the malformed line, if any
 #endif
 void destroy_filter(filter *f);
 
+/* Sparse dotplots */
+sparse_dotplot *create_sparse_dotplot(dotplot *dp);
+sparse_dotplot *create_sparse_dotplot_from_alignments(int width, int height, alignment_array *alignments);
+void destroy_sparse_dotplot(sparse_dotplot *sp);
+sparse_dotplot *apply_filter_sparse(sparse_dotplot *sp, filter *f); // cells scored 0 are dropped
+gdImagePtr render_sparse_dotplot(sparse_dotplot *sp, cell_renderer *renderer);
+
+/* Tiled comparisons: the match matrix is only ever built one tile at a time */
+gdImagePtr run_tiled_dotplot(char *seq1, char *seq2, int length, int tile_size, filter_pipeline *pipeline, cell_renderer *renderer, alignment_sink sink, void *arg); // pipeline, renderer and sink may be NULL
+alignment_array *find_alignments_tiled(char *seq1, char *seq2, int length, int tile_size); // same as find_alignments on create_dotplot(seq1, seq2)
+void collect_alignment(alignment *algn, void *alignments); // an alignment_sink that appends to an alignment_array
+
+/* Filter pipelines */
+filter_pipeline *create_filter_pipeline(int width, int height);
+void destroy_filter_pipeline(filter_pipeline *pipeline); // the filters and the mask are left alone
+void add_filter_round(filter_pipeline *pipeline, filter *f);
+void set_alignment_mask(filter_pipeline *pipeline, alignment_array *alignments);
+gdImagePtr run_filter_pipeline(filter_pipeline *pipeline, dotplot *dp, cell_renderer *renderer); // dp may be NULL when masked
+
 /* Color chooser */
 color_chooser *create_color_chooser(color default_color);
 void destroy_color_chooser(color_chooser *cc);
-int add_color(color_chooser *cc, float start, float end, color c); // returns an error code
+int add_color(color_chooser *cc, float start, float end, color c); // returns an error code (out of bounds, or the chooser is full)
 color color_for(color_chooser *cc, float value);
+color_table *compile_color_chooser(color_chooser *cc);
+int color_table_search(color_table *table, float value);
+void destroy_color_table(color_table *table);
+
+/* Index of the range (or count for the default color) holding value */
+static inline int color_table_index(color_table *table, float value) {
+	if (value >= 0 && value < 1) {
+		int index = table->index[(int) (value * COLOR_TABLE_BINS)];
+		if (index >= 0) {
+			return index;
+		}
+	}
+	
+	return color_table_search(table, value);
+}
@@ -0,0 +1,333 @@
+#include "fasta.h"
+#include "gzip.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+* Reading side of FASTA files. The file is mapped, so finding records costs a jump from one
+* '>' to the next and reading a record is a single copy out of the page cache. Compressed
+* files are inflated into memory once and then read the same way
+*/
+#ifdef __unix__
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/************** Private **************/
+/*
+* The base a byte of sequence stands for, 0 for line breaks and other whitespace
+*/
+static inline char _normalize(unsigned char c) {
+	if (c >= 'a' && c <= 'z') {
+		return c - ('a' - 'A');
+	}
+	
+	return c > ' ' && c < 127 ? c : 0;
+}
+
+/*
+* Copy the bases of one line, dropping anything that isn't one
+*/
+size_t _copy_line(const char *from, size_t size, char *to) {
+	size_t count = 0;
+	size_t i;
+	for (i = 0; i < size; i++) { // branch free: dropped bytes are written, then overwritten
+		char base = _normalize(from[i]);
+		to[count] = base;
+		count += base != 0;
+	}
+	
+	return count;
+}
+
+/*
+* Lines are copied whole and uppercased in place, which vectorizes; only a line with
+* whitespace inside it (other than its line break) is copied a byte at a time
+*/
+size_t _copy_bases(const char *from, size_t size, char *to) {
+	size_t count = 0;
+	const char *end = from + size;
+	while (from < end) {
+		const char *newline = memchr(from, '\n', end - from);
+		size_t length = (newline != NULL ? newline : end) - from;
+		if (length > 0 && from[length-1] == '\r') {
+			length--;
+		}
+		
+		char *line = to + count;
+		int spaces = 0;
+		size_t i;
+		memcpy(line, from, length);
+		for (i = 0; i < length; i++) {
+			unsigned char c = line[i];
+			line[i] = c >= 'a' && c <= 'z' ? c - ('a' - 'A') : c;
+			spaces |= c <= ' ' || c >= 127;
+		}
+		count += spaces ? _copy_line(from, length, line) : length;
+		from = newline != NULL ? newline + 1 : end;
+	}
+	
+	return count;
+}
+
+fasta_record *_add_record(fasta_file *file, size_t *capacity) {
+	if (file->count == *capacity) {
+		*capacity = *capacity ? *capacity * 2 : 8;
+		file->records = realloc(file->records, *capacity * sizeof(fasta_record));
+	}
+	
+	fasta_record *record = &file->records[file->count++];
+	record->length = -1;
+	record->line_bases = 0;
+	record->line_bytes = 0;
+	return record;
+}
+
+/*
+* Find the records by their headers. Sequence lines never contain '>', so each header is
+* found with one memchr
+*/
+void _scan_records(fasta_file *file) {
+	const char *data = file->data;
+	size_t capacity = 0;
+	size_t position = 0;
+	if (file->size > 0 && data[0] != '>') { // bare sequence
+		fasta_record *record = _add_record(file, &capacity);
+		record->name = strdup("");
+		record->offset = 0;
+	}
+	
+	while (position < file->size) {
+		const char *header = memchr(data + position, '>', file->size - position);
+		if (header == NULL) {
+			break;
+		}
+		
+		size_t start = header - data;
+		if (start > 0 && data[start-1] != '\n') { // not at the start of a line
+			position = start + 1;
+			continue;
+		}
+		if (file->count > 0) {
+			file->records[file->count-1].end = start;
+		}
+		
+		const char *line_end = memchr(header, '\n', file->size - start);
+		size_t next = line_end != NULL ? (size_t) (line_end - data) + 1 : file->size;
+		size_t name_length = 0;
+		while (start + 1 + name_length < next && _normalize(header[1 + name_length]) != 0) {
+			name_length++;
+		}
+		
+		fasta_record *record = _add_record(file, &capacity);
+		record->name = strndup(header + 1, name_length);
+		record->offset = next;
+		position = next;
+	}
+	if (file->count > 0) {
+		file->records[file->count-1].end = file->size;
+	}
+}
+
+/*
+* Byte of base i of a record laid out in lines of equal length
+*/
+static inline size_t _base_offset(fasta_record *record, long i) {
+	return record->offset + (size_t) (i / record->line_bases) * record->line_bytes + i % record->line_bases;
+}
+
+/*
+* Load the records from <filename>.fai (name, length, offset, bases per line, bytes per
+* line). An index older than the file, or one that points outside it, is ignored
+*/
+int _read_fai(fasta_file *file, char *filename, struct stat *source) {
+	char *name = malloc(strlen(filename) + 5);
+	strcpy(name, filename);
+	strcat(name, ".fai");
+	struct stat st;
+	FILE *in = NULL;
+	if (stat(name, &st) == 0 && st.st_mtime >= source->st_mtime) {
+		in = fopen(name, "r");
+	}
+	free(name);
+	if (in == NULL) {
+		return 0;
+	}
+	
+	size_t capacity = 0;
+	char *line = NULL;
+	size_t line_capacity = 0;
+	int valid = 1;
+	while (valid && getline(&line, &line_capacity, in) > 0) {
+		char *record_name = strtok(line, "\t\r\n");
+		if (record_name == NULL) { // blank line
+			continue;
+		}
+		
+		char *fields[4];
+		int i;
+		for (i = 0; i < 4; i++) {
+			fields[i] = strtok(NULL, "\t\r\n");
+		}
+		if (fields[3] == NULL) {
+			valid = 0;
+			break;
+		}
+		
+		fasta_record *record = _add_record(file, &capacity);
+		record->name = strdup(record_name);
+		record->length = atol(fields[0]);
+		record->offset = (size_t) atoll(fields[1]);
+		record->line_bases = atol(fields[2]);
+		record->line_bytes = atol(fields[3]);
+		record->end = record->offset;
+		if (record->length < 0 || record->line_bases <= 0 || record->line_bytes < record->line_bases) {
+			valid = 0;
+			break;
+		}
+		if (record->length > 0) {
+			record->end = _base_offset(record, record->length - 1) + 1;
+		}
+		valid = record->offset <= file->size && record->end <= file->size;
+	}
+	
+	free(line);
+	fclose(in);
+	if (!valid) {
+		size_t i;
+		for (i = 0; i < file->count; i++) {
+			free(file->records[i].name);
+		}
+		free(file->records);
+		file->records = NULL;
+		file->count = 0;
+	}
+	
+	return valid;
+}
+
+/************** Public  **************/
+fasta_file *open_fasta(char *filename) {
+	int fd = open(filename, O_RDONLY);
+	if (fd < 0) {
+		return NULL;
+	}
+	
+	struct stat st;
+	if (fstat(fd, &st) != 0) {
+		close(fd);
+		return NULL;
+	}
+	
+	void *map = NULL;
+	if (st.st_size > 0) {
+		map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	}
+	close(fd); // the mapping keeps the file open
+	if (map == MAP_FAILED) {
+		return NULL;
+	}
+	if (map != NULL) {
+		madvise(map, st.st_size, MADV_SEQUENTIAL);
+	}
+	
+	char *inflated = NULL;
+	size_t size = st.st_size;
+	if (is_gzip(map, st.st_size)) {
+		inflated = inflate_gzip(map, st.st_size, &size);
+		munmap(map, st.st_size);
+		if (inflated == NULL) {
+			return NULL;
+		}
+	}
+	
+	fasta_file *file = malloc(sizeof(fasta_file));
+	file->count = 0;
+	file->records = NULL;
+	file->data = inflated != NULL ? inflated : map;
+	file->size = size;
+	file->inflated = inflated != NULL;
+	file->indexed = _read_fai(file, filename, &st);
+	if (!file->indexed) {
+		_scan_records(file);
+	}
+	
+	return file;
+}
+
+void close_fasta(fasta_file *file) {
+	size_t i;
+	for (i = 0; i < file->count; i++) {
+		free(file->records[i].name);
+	}
+	if (file->inflated) {
+		free((void*) file->data);
+	}
+	else if (file->data != NULL) {
+		munmap((void*) file->data, file->size);
+	}
+	free(file->records);
+	free(file);
+}
+
+fasta_record *find_fasta_record(fasta_file *file, const char *name) {
+	size_t i;
+	for (i = 0; i < file->count; i++) {
+		if (strcmp(file->records[i].name, name) == 0) {
+			return &file->records[i];
+		}
+	}
+	
+	return NULL;
+}
+
+char *read_fasta_record(fasta_file *file, fasta_record *record) {
+	size_t size = record->end - record->offset;
+	char *seq = malloc(size + 1);
+	size_t count = _copy_bases(file->data + record->offset, size, seq);
+	seq[count] = '\0';
+	record->length = count;
+	return count < size ? realloc(seq, count + 1) : seq;
+}
+
+/*
+* With a .fai the bytes of the range are found directly from the line layout; otherwise the
+* whole record has to be read to count its bases
+*/
+char *read_fasta_range(fasta_file *file, fasta_record *record, long start, long length) {
+	if (start < 0 || length < 0 || (record->length >= 0 && start + length > record->length)) {
+		return NULL;
+	}
+	
+	if (record->line_bases > 0) {
+		size_t from = length > 0 ? _base_offset(record, start) : 0;
+		size_t size = length > 0 ? _base_offset(record, start + length - 1) + 1 - from : 0;
+		char *seq = malloc(size + 1);
+		size_t count = _copy_bases(file->data + from, size, seq);
+		if (count == (size_t) length) {
+			seq[count] = '\0';
+			return seq;
+		}
+		free(seq); // lines aren't laid out the way the index says
+	}
+	
+	char *whole = read_fasta_record(file, record);
+	if (start + length > record->length) {
+		free(whole);
+		return NULL;
+	}
+	
+	memmove(whole, whole + start, length);
+	whole[length] = '\0';
+	return whole;
+}
+
+packed_sequence *read_fasta_packed(fasta_file *file, fasta_record *record) {
+	char *seq = read_fasta_record(file, record);
+	packed_sequence *packed = pack_sequence(seq);
+	free(seq);
+	return packed;
+}
+#endif
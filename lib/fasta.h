@@ -0,0 +1,42 @@
+#ifndef DOTPLOT_FASTA_H
+#define DOTPLOT_FASTA_H
+
+#include <stddef.h>
+#include "packed.h"
+
+/*
+* FASTA files, read through a memory map. Opening a file only finds where its records are
+* (from <filename>.fai when there is an up to date one, otherwise by jumping from header to
+* header); bases are copied out of the map when a record or a range of one is read. Bases
+* come out uppercase with line breaks (LF or CRLF) and other whitespace left out, so they
+* can go straight to pack_sequence. gzip and bgzip files are inflated into memory first (a
+* .fai of a bgzip file holds uncompressed offsets, so it works the same)
+*/
+#ifdef __unix__
+typedef struct {
+	char *name;        // header up to the first whitespace, "" for a file without headers
+	size_t offset;     // first byte of the sequence in the file
+	size_t end;        // one past the last byte of the sequence
+	long length;       // number of bases, -1 until known
+	long line_bases;   // bases per line from the .fai, 0 without one
+	long line_bytes;   // bytes per line, line break included
+} fasta_record;
+
+typedef struct {
+	size_t count;
+	fasta_record *records; // in file order
+	const char *data;
+	size_t size;
+	int indexed;           // records came from a .fai
+	int inflated;          // data was decompressed into memory rather than mapped
+} fasta_file;
+
+fasta_file *open_fasta(char *filename); // returns NULL if the file can't be read
+void close_fasta(fasta_file *file);
+fasta_record *find_fasta_record(fasta_file *file, const char *name); // NULL if there is no such record
+char *read_fasta_record(fasta_file *file, fasta_record *record); // returns a malloc'd string
+char *read_fasta_range(fasta_file *file, fasta_record *record, long start, long length); // NULL if out of range
+packed_sequence *read_fasta_packed(fasta_file *file, fasta_record *record);
+#endif
+
+#endif
@@ -0,0 +1,234 @@
+#include "gzip.h"
+#include "pool.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+/*
+* gzip members start with a 10 byte header. A BGZF member sets FEXTRA and carries a "BC"
+* subfield with its total size minus one, and ends with the CRC32 and size of its data, so
+* the blocks of a file and where each one lands in the output are known before any of
+* them is inflated
+*/
+
+/************** Private **************/
+#define GZIP_HEADER 10
+#define GZIP_TRAILER 8
+#define BGZF_HEADER 18 // header with XLEN and the "BC" subfield
+#define BGZF_TASKS_PER_THREAD 8
+
+static int inflate_threads = 1;
+
+typedef struct {
+	size_t offset; // of the member in the input
+	size_t size;   // whole member, header and trailer included
+	size_t output; // where its data goes in the output
+} bgzf_block;
+
+typedef struct {
+	const uint8_t *data;
+	char *output;
+	bgzf_block *blocks;
+	size_t count;
+	int tasks;
+	int failed;
+} bgzf_job;
+
+static inline uint16_t _read16(const uint8_t *p) {
+	return p[0] | (p[1] << 8);
+}
+
+static inline uint32_t _read32(const uint8_t *p) {
+	return (uint32_t) p[0] | ((uint32_t) p[1] << 8) | ((uint32_t) p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+/*
+* Size of the BGZF member at data, 0 if it isn't one
+*/
+size_t _bgzf_block_size(const uint8_t *data, size_t size) {
+	if (size < BGZF_HEADER + GZIP_TRAILER || data[0] != 0x1f || data[1] != 0x8b || data[2] != 8 || !(data[3] & 4)) {
+		return 0;
+	}
+	
+	size_t extra = _read16(data + 10);
+	size_t position = 12;
+	size_t end = 12 + extra;
+	while (position + 4 <= end && end <= size) { // find the "BC" subfield among the extra fields
+		size_t length = _read16(data + position + 2);
+		if (data[position] == 'B' && data[position+1] == 'C' && length == 2 && position + 6 <= end) {
+			size_t block = (size_t) _read16(data + position + 4) + 1;
+			return block <= size && block >= end + GZIP_TRAILER ? block : 0;
+		}
+		position += 4 + length;
+	}
+	
+	return 0;
+}
+
+int _inflate_block(z_stream *stream, const uint8_t *data, bgzf_block *block, char *output) {
+	size_t start = 12 + _read16(data + 10);
+	const uint8_t *trailer = data + block->size - GZIP_TRAILER;
+	uint32_t expected = _read32(trailer + 4);
+	if (inflateReset(stream) != Z_OK) {
+		return 0;
+	}
+	
+	stream->next_in = (Bytef*) data + start;
+	stream->avail_in = block->size - start - GZIP_TRAILER;
+	stream->next_out = (Bytef*) output;
+	stream->avail_out = expected;
+	if (inflate(stream, Z_FINISH) != Z_STREAM_END || stream->avail_out != 0) {
+		return 0;
+	}
+	
+	return crc32(0, (Bytef*) output, expected) == _read32(trailer);
+}
+
+void _inflate_band(void *arg, int task) {
+	bgzf_job *job = (bgzf_job*) arg;
+	size_t first = job->count * task / job->tasks;
+	size_t last = job->count * (task + 1) / job->tasks;
+	z_stream stream;
+	memset(&stream, 0, sizeof(stream));
+	if (inflateInit2(&stream, -15) != Z_OK) { // raw deflate: the headers were parsed already
+		job->failed = 1;
+		return;
+	}
+	
+	size_t i;
+	for (i = first; i < last && !job->failed; i++) {
+		bgzf_block *block = &job->blocks[i];
+		if (!_inflate_block(&stream, job->data + block->offset, block, job->output + block->output)) {
+			job->failed = 1;
+		}
+	}
+	inflateEnd(&stream);
+}
+
+char *_inflate_bgzf(const uint8_t *data, size_t size, size_t *inflated) {
+	size_t count = 0, capacity = 64;
+	bgzf_block *blocks = malloc(capacity * sizeof(bgzf_block));
+	size_t position = 0;
+	size_t output = 0;
+	while (position < size) {
+		size_t block = _bgzf_block_size(data + position, size - position);
+		if (block == 0) {
+			free(blocks);
+			return NULL;
+		}
+		if (count == capacity) {
+			capacity *= 2;
+			blocks = realloc(blocks, capacity * sizeof(bgzf_block));
+		}
+		
+		blocks[count].offset = position;
+		blocks[count].size = block;
+		blocks[count].output = output;
+		output += _read32(data + position + block - 4);
+		position += block;
+		count++;
+	}
+	
+	bgzf_job job = {
+		.data = data,
+		.output = malloc(output + 1),
+		.blocks = blocks,
+		.count = count,
+		.tasks = count < (size_t) inflate_threads * BGZF_TASKS_PER_THREAD ? (int) count : inflate_threads * BGZF_TASKS_PER_THREAD,
+		.failed = 0
+	};
+	if (job.tasks > 0) {
+		pool_run(inflate_threads, job.tasks, _inflate_band, &job);
+	}
+	
+	free(blocks);
+	if (job.failed) {
+		free(job.output);
+		return NULL;
+	}
+	
+	*inflated = output;
+	return job.output;
+}
+
+/*
+* Inflate the members of a gzip file one after the other. The output grows as needed,
+* starting from the size recorded in the last member
+*/
+char *_inflate_stream(const uint8_t *data, size_t size, size_t *inflated) {
+	size_t capacity = _read32(data + size - 4);
+	if (capacity < size) {
+		capacity = size * 4; // recorded sizes wrap at 4 GB
+	}
+	
+	char *output = malloc(capacity + 1);
+	size_t length = 0;
+	z_stream stream;
+	memset(&stream, 0, sizeof(stream));
+	if (inflateInit2(&stream, 15 + 16) != Z_OK) { // gzip wrapper
+		free(output);
+		return NULL;
+	}
+	
+	stream.next_in = (Bytef*) data;
+	stream.avail_in = size;
+	int result = Z_OK;
+	while (result != Z_STREAM_END) {
+		if (length == capacity) {
+			capacity *= 2;
+			output = realloc(output, capacity + 1);
+		}
+		
+		size_t room = capacity - length < UINT32_MAX ? capacity - length : UINT32_MAX;
+		stream.next_out = (Bytef*) output + length;
+		stream.avail_out = room;
+		result = inflate(&stream, Z_NO_FLUSH);
+		length += room - stream.avail_out;
+		if (result == Z_STREAM_END && stream.avail_in >= 2 && stream.next_in[0] == 0x1f && stream.next_in[1] == 0x8b) {
+			result = inflateReset(&stream); // another member follows
+		}
+		if (result != Z_OK && result != Z_STREAM_END && !(result == Z_BUF_ERROR && stream.avail_out == 0)) {
+			break; // corrupt or truncated
+		}
+	}
+	inflateEnd(&stream);
+	
+	if (result != Z_STREAM_END) {
+		free(output);
+		return NULL;
+	}
+	
+	*inflated = length;
+	return output;
+}
+
+/************** Public  **************/
+void set_inflate_threads(int threads) {
+	inflate_threads = threads > 0 ? threads : 1;
+}
+
+int is_gzip(const void *data, size_t size) {
+	const uint8_t *bytes = data;
+	return size >= GZIP_HEADER + GZIP_TRAILER && bytes[0] == 0x1f && bytes[1] == 0x8b && bytes[2] == 8;
+}
+
+int is_bgzf(const void *data, size_t size) {
+	return _bgzf_block_size(data, size) != 0;
+}
+
+char *inflate_gzip(const void *data, size_t size, size_t *inflated) {
+	if (!is_gzip(data, size)) {
+		return NULL;
+	}
+	
+	char *output = is_bgzf(data, size) ? _inflate_bgzf(data, size, inflated) : NULL;
+	if (output == NULL) { // plain gzip, or BGZF blocks followed by other members
+		output = _inflate_stream(data, size, inflated);
+	}
+	if (output != NULL) {
+		output[*inflated] = '\0';
+	}
+	
+	return output;
+}
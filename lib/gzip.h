@@ -0,0 +1,17 @@
+#ifndef DOTPLOT_GZIP_H
+#define DOTPLOT_GZIP_H
+
+#include <stddef.h>
+
+/*
+* Decompression of gzip input, so sequence and value files can be read as .gz or bgzip
+* files. BGZF files (as written by bgzip) are a series of small gzip members that record
+* their own sizes, so their blocks are inflated on several threads straight into place
+* in the output; any other gzip file is inflated member by member on one thread
+*/
+void set_inflate_threads(int threads); // threads used for BGZF blocks (1 by default)
+int is_gzip(const void *data, size_t size);
+int is_bgzf(const void *data, size_t size);
+char *inflate_gzip(const void *data, size_t size, size_t *inflated); // malloc'd, NULL if the data is corrupt
+
+#endif
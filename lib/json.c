@@ -0,0 +1,224 @@
+#include "json.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/*
+* Alignment lists on repeat-heavy pairs run into the millions, so the emitter never goes
+* through printf: strings are copied into the buffer as slices, integers are formatted by
+* hand and the buffer only leaves the process once it is full
+*/
+
+#define JSON_BUFFER_SIZE (1 << 18)
+
+/************** Private **************/
+int _json_write_out(json_writer *writer, const char *data, size_t length) {
+	if (writer->file != NULL) {
+		return fwrite(data, 1, length, writer->file) == length;
+	}
+	
+	while (length > 0) {
+		ssize_t written = write(writer->fd, data, length);
+		if (written < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return 0;
+		}
+		data += written;
+		length -= written;
+	}
+	return 1;
+}
+
+void _json_put(json_writer *writer, const char *data, size_t length) {
+	if (writer->used + length > writer->size) {
+		json_flush(writer);
+		if (length > writer->size) { // too big to be worth copying
+			if (!writer->failed && !_json_write_out(writer, data, length)) {
+				writer->failed = 1;
+			}
+			return;
+		}
+	}
+	
+	memcpy(writer->buffer + writer->used, data, length);
+	writer->used += length;
+}
+
+void _json_putc(json_writer *writer, char c) {
+	if (writer->used == writer->size) {
+		json_flush(writer);
+	}
+	writer->buffer[writer->used++] = c;
+}
+
+void _json_newline(json_writer *writer) {
+	int i;
+	_json_putc(writer, '\n');
+	for (i = 0; i < writer->depth; i++) {
+		_json_put(writer, "  ", 2);
+	}
+}
+
+/*
+* Separate a new value from the one before it. Values directly following a key are
+* already placed
+*/
+void _json_value(json_writer *writer) {
+	if (writer->keyed) {
+		writer->keyed = 0;
+		return;
+	}
+	if (!writer->first) {
+		_json_putc(writer, ',');
+	}
+	if (writer->style == JSON_PRETTY && writer->depth > 0) {
+		_json_newline(writer);
+	}
+}
+
+void _json_begin(json_writer *writer, char open) {
+	_json_value(writer);
+	_json_putc(writer, open);
+	writer->depth++;
+	writer->first = 1;
+}
+
+void _json_end(json_writer *writer, char close) {
+	writer->depth--;
+	if (writer->style == JSON_PRETTY && !writer->first) {
+		_json_newline(writer);
+	}
+	_json_putc(writer, close);
+	writer->first = 0;
+}
+
+json_writer *_json_writer_allocate(FILE *file, int fd, json_style style) {
+	json_writer *writer = malloc(sizeof(json_writer));
+	writer->file = file;
+	writer->fd = fd;
+	writer->style = style;
+	writer->depth = 0;
+	writer->first = 1;
+	writer->keyed = 0;
+	writer->failed = 0;
+	writer->size = JSON_BUFFER_SIZE;
+	writer->used = 0;
+	writer->buffer = malloc(writer->size);
+	
+	return writer;
+}
+
+/************** Public  **************/
+json_writer *create_json_writer(FILE *file, json_style style) {
+	return _json_writer_allocate(file, -1, style);
+}
+
+json_writer *create_json_writer_fd(int fd, json_style style) {
+	return _json_writer_allocate(NULL, fd, style);
+}
+
+int destroy_json_writer(json_writer *writer) {
+	int ok = json_flush(writer);
+	if (writer->file != NULL && fflush(writer->file) != 0) {
+		ok = 0;
+	}
+	
+	free(writer->buffer);
+	free(writer);
+	return ok;
+}
+
+int json_flush(json_writer *writer) {
+	if (writer->used > 0 && !writer->failed && !_json_write_out(writer, writer->buffer, writer->used)) {
+		writer->failed = 1;
+	}
+	
+	writer->used = 0;
+	return !writer->failed;
+}
+
+void json_begin_array(json_writer *writer) {
+	_json_begin(writer, '[');
+}
+
+void json_end_array(json_writer *writer) {
+	_json_end(writer, ']');
+}
+
+void json_begin_object(json_writer *writer) {
+	_json_begin(writer, '{');
+}
+
+void json_end_object(json_writer *writer) {
+	_json_end(writer, '}');
+}
+
+void json_key(json_writer *writer, const char *key) {
+	json_string(writer, key, strlen(key));
+	if (writer->style == JSON_PRETTY) {
+		_json_put(writer, ": ", 2);
+	}
+	else {
+		_json_putc(writer, ':');
+	}
+	
+	writer->keyed = 1;
+}
+
+/*
+* Write a string, escaped. Clean stretches go into the buffer as whole slices, so strings
+* without anything to escape (sequences, as a rule) cost one pass and one copy
+*/
+void json_string(json_writer *writer, const char *value, size_t length) {
+	static const char hex[] = "0123456789abcdef";
+	_json_value(writer);
+	_json_putc(writer, '"');
+	size_t start = 0, i;
+	for (i = 0; i < length; i++) {
+		unsigned char c = value[i];
+		if (c >= 0x20 && c != '"' && c != '\\') {
+			continue;
+		}
+		
+		_json_put(writer, value + start, i - start);
+		char escape[6] = {'\\', c, 0, 0, 0, 0};
+		size_t size = 2;
+		if (c == '\n' || c == '\r' || c == '\t') {
+			escape[1] = c == '\n' ? 'n' : c == '\r' ? 'r' : 't';
+		}
+		else if (c < 0x20) {
+			escape[1] = 'u';
+			escape[2] = '0';
+			escape[3] = '0';
+			escape[4] = hex[c >> 4];
+			escape[5] = hex[c & 15];
+			size = 6;
+		}
+		_json_put(writer, escape, size);
+		start = i + 1;
+	}
+	_json_put(writer, value + start, length - start);
+	_json_putc(writer, '"');
+	writer->first = 0;
+}
+
+void json_int(json_writer *writer, long value) {
+	char digits[24];
+	char *end = digits + sizeof(digits);
+	char *p = end;
+	unsigned long magnitude = value < 0 ? -(unsigned long) value : (unsigned long) value;
+	do {
+		*--p = '0' + magnitude % 10;
+		magnitude /= 10;
+	} while (magnitude > 0);
+	if (value < 0) {
+		*--p = '-';
+	}
+	
+	_json_value(writer);
+	_json_put(writer, p, end - p);
+	writer->first = 0;
+}
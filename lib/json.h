@@ -0,0 +1,42 @@
+#ifndef DOTPLOT_JSON_H
+#define DOTPLOT_JSON_H
+
+#include <stddef.h>
+#include <stdio.h>
+
+/*
+* A buffered JSON emitter. Output collects in one large buffer and goes out in big
+* chunks, either through a FILE* or straight to a file descriptor
+*/
+typedef enum {
+	JSON_COMPACT, // everything on one line
+	JSON_PRETTY   // one member per line, indented by two spaces
+} json_style;
+
+typedef struct {
+	FILE *file; // NULL when writing to fd
+	int fd;
+	json_style style;
+	int depth;
+	int first; // nothing written yet at this depth, so no comma is due
+	int keyed; // a key was just written, so its value needs no separator
+	int failed; // set once a flush fails; later output is dropped
+	char *buffer;
+	size_t size;
+	size_t used;
+} json_writer;
+
+json_writer *create_json_writer(FILE *file, json_style style);
+json_writer *create_json_writer_fd(int fd, json_style style);
+int destroy_json_writer(json_writer *writer); // flushes first, returns 0 if any output was lost
+int json_flush(json_writer *writer);
+
+void json_begin_array(json_writer *writer);
+void json_end_array(json_writer *writer);
+void json_begin_object(json_writer *writer);
+void json_end_object(json_writer *writer);
+void json_key(json_writer *writer, const char *key);
+void json_string(json_writer *writer, const char *value, size_t length); // quotes, backslashes and control characters are escaped
+void json_int(json_writer *writer, long value);
+
+#endif
@@ -0,0 +1,119 @@
+#include "kernel.h"
+#include <stddef.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+	#include <immintrin.h>
+	#define HAVE_X86_KERNELS
+#endif
+
+/*
+* Row match kernels for create_dotplot. Each kernel broadcasts a base from the second
+* sequence and compares it against a block of the first sequence per instruction, writing
+* the comparison masks straight into the packed row. The kernel is picked once at runtime
+* from CPUID so one binary runs everywhere
+*/
+
+/************** Private **************/
+/*
+* Compare the trailing (less than 64) bases one at a time
+*/
+static uint64_t _match_tail(const char *seq1, int length, char base) {
+	uint64_t word = 0;
+	int i;
+	for (i = 0; i < length; i++) {
+		if (seq1[i] == base) {
+			word |= (uint64_t) 1 << i;
+		}
+	}
+	
+	return word;
+}
+
+/************** Public  **************/
+void match_row_scalar(const char *seq1, int width, char base, uint64_t *row) {
+	int x;
+	for (x = 0; x + 64 <= width; x += 64) {
+		row[x >> 6] = _match_tail(seq1 + x, 64, base);
+	}
+	if (x < width) {
+		row[x >> 6] = _match_tail(seq1 + x, width - x, base);
+	}
+}
+
+#ifdef HAVE_X86_KERNELS
+__attribute__((target("sse2")))
+void match_row_sse2(const char *seq1, int width, char base, uint64_t *row) {
+	__m128i needle = _mm_set1_epi8(base);
+	int x;
+	for (x = 0; x + 64 <= width; x += 64) {
+		const __m128i *block = (const __m128i*) (seq1 + x);
+		uint64_t m0 = (uint16_t) _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128(block), needle));
+		uint64_t m1 = (uint16_t) _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128(block + 1), needle));
+		uint64_t m2 = (uint16_t) _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128(block + 2), needle));
+		uint64_t m3 = (uint16_t) _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128(block + 3), needle));
+		row[x >> 6] = m0 | (m1 << 16) | (m2 << 32) | (m3 << 48);
+	}
+	if (x < width) {
+		row[x >> 6] = _match_tail(seq1 + x, width - x, base);
+	}
+}
+
+__attribute__((target("avx2")))
+void match_row_avx2(const char *seq1, int width, char base, uint64_t *row) {
+	__m256i needle = _mm256_set1_epi8(base);
+	int x;
+	for (x = 0; x + 64 <= width; x += 64) {
+		const __m256i *block = (const __m256i*) (seq1 + x);
+		uint64_t lo = (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256(block), needle));
+		uint64_t hi = (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256(block + 1), needle));
+		row[x >> 6] = lo | (hi << 32);
+	}
+	if (x < width) {
+		row[x >> 6] = _match_tail(seq1 + x, width - x, base);
+	}
+}
+
+__attribute__((target("avx512f,avx512bw")))
+void match_row_avx512(const char *seq1, int width, char base, uint64_t *row) {
+	__m512i needle = _mm512_set1_epi8(base);
+	int x;
+	for (x = 0; x + 64 <= width; x += 64) {
+		row[x >> 6] = _mm512_cmpeq_epi8_mask(_mm512_loadu_si512(seq1 + x), needle);
+	}
+	if (x < width) {
+		row[x >> 6] = _match_tail(seq1 + x, width - x, base);
+	}
+}
+#endif
+
+match_kernel choose_match_kernel(void) {
+	static match_kernel chosen = NULL;
+	if (chosen != NULL) {
+		return chosen;
+	}
+	
+	chosen = match_row_scalar;
+#ifdef HAVE_X86_KERNELS
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx512bw")) {
+		chosen = match_row_avx512;
+	}
+	else if (__builtin_cpu_supports("avx2")) {
+		chosen = match_row_avx2;
+	}
+	else if (__builtin_cpu_supports("sse2")) {
+		chosen = match_row_sse2;
+	}
+#endif
+	
+	return chosen;
+}
+
+const char *match_kernel_name(match_kernel kernel) {
+#ifdef HAVE_X86_KERNELS
+	if (kernel == match_row_avx512) return "avx512";
+	if (kernel == match_row_avx2) return "avx2";
+	if (kernel == match_row_sse2) return "sse2";
+#endif
+	return "scalar";
+}
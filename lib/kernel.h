@@ -0,0 +1,23 @@
+#ifndef DOTPLOT_KERNEL_H
+#define DOTPLOT_KERNEL_H
+
+#include <stdint.h>
+
+/*
+* Match kernels fill one bit-packed row of the dotplot: bit x of the row is set when
+* seq1[x] == base. Every word covering the first `width` bases is overwritten
+*/
+typedef void (*match_kernel)(const char *seq1, int width, char base, uint64_t *row);
+
+void match_row_scalar(const char *seq1, int width, char base, uint64_t *row);
+#if defined(__x86_64__) || defined(__i386__)
+	void match_row_sse2(const char *seq1, int width, char base, uint64_t *row);
+	void match_row_avx2(const char *seq1, int width, char base, uint64_t *row);
+	void match_row_avx512(const char *seq1, int width, char base, uint64_t *row);
+#endif
+
+/* Pick the widest kernel the running CPU supports */
+match_kernel choose_match_kernel(void);
+const char *match_kernel_name(match_kernel kernel);
+
+#endif
@@ -0,0 +1,218 @@
+#include "kmer.h"
+#include "pool.h"
+#include <stdint.h>
+#include <stdlib.h>
+
+/*
+* k-mer seeded alignment search. Any run of at least n matches along a diagonal contains
+* an exact k-mer hit for every k <= n, so instead of walking the whole matrix we index the
+* k-mers of seq1 in a direct-address table (2 bits per base) and only extend the hits
+* found for the k-mers of seq2. Runtime follows the number of hits, not the matrix area
+*/
+
+/************** Private **************/
+#define MAX_K 12
+
+typedef struct {
+	const char *seq1;
+	const char *seq2;
+	int width;
+	int height;
+	int length;
+	int k;
+	uint32_t *starts;    // starts[c]..starts[c+1] are the positions of k-mer c in positions
+	uint32_t *positions; // positions in seq1, grouped by k-mer
+	int tasks;
+	run **found;         // per-task results
+	size_t *counts;
+} kmer_job;
+
+static inline int _encode_base(char base) {
+	switch (base) {
+		case 'A': return 0;
+		case 'C': return 1;
+		case 'G': return 2;
+		case 'T': return 3;
+		default:  return -1;
+	}
+}
+
+int _encodable(const char *seq, int length) {
+	int i;
+	for (i = 0; i < length; i++) {
+		if (_encode_base(seq[i]) < 0) {
+			return 0;
+		}
+	}
+	
+	return 1;
+}
+
+/*
+* Pick k: never more than the minimum run length, and small enough that the table is not
+* much larger than the sequence it indexes
+*/
+int _choose_k(int length, int width) {
+	int k = length < MAX_K ? length : MAX_K;
+	while (k > 1 && ((uint64_t) 1 << (2 * k)) > (uint64_t) width * 4) {
+		k--;
+	}
+	
+	return k;
+}
+
+/*
+* Counting sort of seq1's k-mer positions into a direct-address table
+*/
+void _build_index(kmer_job *job) {
+	size_t table = (size_t) 1 << (2 * job->k);
+	uint32_t mask = (uint32_t) (table - 1);
+	int kmers = job->width - job->k + 1;
+	uint32_t code = 0;
+	int i;
+	
+	job->starts = calloc(table + 1, sizeof(uint32_t));
+	job->positions = malloc((kmers > 0 ? kmers : 1) * sizeof(uint32_t));
+	for (i = 0; i < job->width; i++) {
+		code = ((code << 2) | _encode_base(job->seq1[i])) & mask;
+		if (i >= job->k - 1) {
+			job->starts[code + 1]++;
+		}
+	}
+	for (i = 0; i < (int) table; i++) {
+		job->starts[i + 1] += job->starts[i];
+	}
+	
+	uint32_t *fill = malloc(table * sizeof(uint32_t));
+	for (i = 0; i < (int) table; i++) {
+		fill[i] = job->starts[i];
+	}
+	code = 0;
+	for (i = 0; i < job->width; i++) {
+		code = ((code << 2) | _encode_base(job->seq1[i])) & mask;
+		if (i >= job->k - 1) {
+			job->positions[fill[code]++] = i - job->k + 1;
+		}
+	}
+	free(fill);
+}
+
+/*
+* Look up the k-mers of seq2 starting in this task's band. Forward k-mers give diagonal
+* hits; reversed k-mers give anti-diagonal hits. Each hit is only extended if it is the
+* first cell of its run, so every run is reported exactly once
+*/
+void _seed_band(void *arg, int task) {
+	kmer_job *job = (kmer_job*) arg;
+	const char *seq1 = job->seq1;
+	const char *seq2 = job->seq2;
+	int k = job->k;
+	uint32_t mask = (uint32_t) (((size_t) 1 << (2 * k)) - 1);
+	int kmers = job->height - k + 1;
+	int start = (int) ((long long) kmers * task / job->tasks);
+	int end = (int) ((long long) kmers * (task + 1) / job->tasks);
+	run *found = NULL;
+	size_t count = 0, capacity = 0;
+	uint32_t forward = 0, reverse = 0;
+	int j, t;
+	
+	for (t = start; t < start + k - 1 && t < job->height; t++) { // prime the rolling codes
+		int base = _encode_base(seq2[t]);
+		forward = ((forward << 2) | base) & mask;
+		reverse = (reverse >> 2) | ((uint32_t) base << (2 * (k - 1)));
+	}
+	for (j = start; j < end; j++) {
+		int base = _encode_base(seq2[j + k - 1]);
+		forward = ((forward << 2) | base) & mask;
+		reverse = (reverse >> 2) | ((uint32_t) base << (2 * (k - 1)));
+		
+		uint32_t h;
+		for (h = job->starts[forward]; h < job->starts[forward + 1]; h++) {
+			int i = job->positions[h];
+			if (i > 0 && j > 0 && seq1[i-1] == seq2[j-1]) {
+				continue; // inside a run found from its first cell
+			}
+			
+			int length = k;
+			while (i + length < job->width && j + length < job->height && seq1[i+length] == seq2[j+length]) {
+				length++;
+			}
+			if (length >= job->length) {
+				run r = {i, j, length, LR};
+				push_run(&found, &count, &capacity, r);
+			}
+		}
+		for (h = job->starts[reverse]; h < job->starts[reverse + 1]; h++) {
+			int i = job->positions[h] + k - 1; // top of the anti-diagonal
+			if (i + 1 < job->width && j > 0 && seq1[i+1] == seq2[j-1]) {
+				continue;
+			}
+			
+			int length = k;
+			while (i - length >= 0 && j + length < job->height && seq1[i-length] == seq2[j+length]) {
+				length++;
+			}
+			if (length >= job->length) {
+				run r = {i - length + 1, j + length - 1, length, UR};
+				push_run(&found, &count, &capacity, r);
+			}
+		}
+	}
+	
+	job->found[task] = found;
+	job->counts[task] = count;
+}
+
+/************** Public  **************/
+run *kmer_find_runs(const char *seq1, int width, const char *seq2, int height, int length, int threads, size_t *count) {
+	*count = 0;
+	if (!_encodable(seq1, width) || !_encodable(seq2, height)) {
+		return NULL;
+	}
+	if (length < 1) {
+		length = 1;
+	}
+	
+	kmer_job job = {
+		.seq1 = seq1,
+		.seq2 = seq2,
+		.width = width,
+		.height = height,
+		.length = length,
+		.k = _choose_k(length, width)
+	};
+	int kmers = height - job.k + 1;
+	if (width < job.k || kmers <= 0) {
+		return malloc(sizeof(run)); // too short to hold a single k-mer, so no runs
+	}
+	
+	_build_index(&job);
+	job.tasks = threads * 8 < kmers ? threads * 8 : kmers;
+	if (job.tasks < 1) {
+		job.tasks = 1;
+	}
+	run *found[job.tasks];
+	size_t counts[job.tasks];
+	job.found = found;
+	job.counts = counts;
+	pool_run(threads, job.tasks, _seed_band, &job);
+	
+	size_t total = 0;
+	int i;
+	for (i = 0; i < job.tasks; i++) {
+		total += counts[i];
+	}
+	run *runs = malloc((total > 0 ? total : 1) * sizeof(run));
+	for (i = 0; i < job.tasks; i++) {
+		size_t r;
+		for (r = 0; r < counts[i]; r++) {
+			runs[(*count)++] = found[i][r];
+		}
+		free(found[i]);
+	}
+	free(job.starts);
+	free(job.positions);
+	
+	sort_runs(runs, *count, width);
+	return runs;
+}
@@ -0,0 +1,13 @@
+#ifndef DOTPLOT_KMER_H
+#define DOTPLOT_KMER_H
+
+#include "run.h"
+
+/*
+* Find every run of at least `length` matches between seq1 and seq2 by seeding from
+* exact k-mer hits. Returns the runs in find_alignments order, or NULL (with *count
+* set to 0) when a sequence holds anything other than A, C, G or T
+*/
+run *kmer_find_runs(const char *seq1, int width, const char *seq2, int height, int length, int threads, size_t *count);
+
+#endif
@@ -0,0 +1,232 @@
+#include "packed.h"
+#include <stdlib.h>
+#include <string.h>
+
+/*
+* 2-bit packed sequences. Comparing two packed words with XOR leaves a zero pair of bits
+* for every matching base, so 32 bases are compared per instruction along a diagonal
+*/
+
+/************** Private **************/
+#define EVEN_BITS 0x5555555555555555ULL
+
+static inline int _base_code(char base) {
+	switch (base) {
+		case 'A': return 0;
+		case 'C': return 1;
+		case 'G': return 2;
+		case 'T': return 3;
+		default:  return -1;
+	}
+}
+
+/*
+* Gather the even bits of a word into its low 32 bits
+*/
+static inline uint32_t _compress_even(uint64_t bits) {
+	bits &= EVEN_BITS;
+	bits = (bits | (bits >> 1)) & 0x3333333333333333ULL;
+	bits = (bits | (bits >> 2)) & 0x0f0f0f0f0f0f0f0fULL;
+	bits = (bits | (bits >> 4)) & 0x00ff00ff00ff00ffULL;
+	bits = (bits | (bits >> 8)) & 0x0000ffff0000ffffULL;
+	bits = (bits | (bits >> 16)) & 0x00000000ffffffffULL;
+	return (uint32_t) bits;
+}
+
+/*
+* One bit per base pair of `diff` that is zero, ie. per matching base
+*/
+static inline uint32_t _zero_pairs(uint64_t diff) {
+	return _compress_even(~(diff | (diff >> 1)));
+}
+
+/*
+* 32 bases starting at base i. The word arrays carry a zero word of padding
+*/
+static inline uint64_t _base_window(packed_sequence *seq, int i) {
+	int word = i >> 5;
+	int shift = (i & 31) * 2;
+	if (shift == 0) {
+		return seq->bases[word];
+	}
+	
+	return (seq->bases[word] >> shift) | (seq->bases[word+1] << (64 - shift));
+}
+
+static inline uint32_t _ambiguous_window(packed_sequence *seq, int i) {
+	int word = i >> 6;
+	int shift = i & 63;
+	if (shift == 0) {
+		return (uint32_t) seq->ambiguous[word];
+	}
+	
+	return (uint32_t) ((seq->ambiguous[word] >> shift) | (seq->ambiguous[word+1] << (64 - shift)));
+}
+
+static inline int _is_ambiguous(packed_sequence *seq, int i) {
+	return seq->ambiguous != NULL && ((seq->ambiguous[i >> 6] >> (i & 63)) & 1);
+}
+
+static inline char _symbol(packed_sequence *seq, int i) {
+	uint64_t before = seq->ambiguous[i >> 6] & (((uint64_t) 1 << (i & 63)) - 1);
+	return seq->symbols[seq->ranks[i >> 6] + __builtin_popcountll(before)];
+}
+
+packed_sequence *_packed_allocate(int length) {
+	size_t words = (size_t) length / 32 + 2; // one word of padding for windows
+	packed_sequence *seq = malloc(sizeof *seq);
+	seq->length = length;
+	seq->bases = calloc(words, sizeof(uint64_t));
+	seq->ambiguous = NULL;
+	seq->ranks = NULL;
+	seq->symbols = NULL;
+	return seq;
+}
+
+/*
+* Set up the side mask once the first ambiguous base turns up
+*/
+void _allocate_ambiguous(packed_sequence *seq) {
+	size_t words = (size_t) seq->length / 64 + 2;
+	seq->ambiguous = calloc(words, sizeof(uint64_t));
+	seq->ranks = calloc(words, sizeof(uint32_t));
+}
+
+void _finish_ambiguous(packed_sequence *seq, const char *symbols_of) {
+	if (seq->ambiguous == NULL) {
+		return;
+	}
+	
+	size_t words = (size_t) seq->length / 64 + 2;
+	size_t w;
+	uint32_t count = 0;
+	for (w = 0; w < words; w++) {
+		seq->ranks[w] = count;
+		count += __builtin_popcountll(seq->ambiguous[w]);
+	}
+	
+	seq->symbols = malloc(count > 0 ? count : 1);
+	int i;
+	uint32_t s = 0;
+	for (i = 0; i < seq->length; i++) {
+		if (_is_ambiguous(seq, i)) {
+			seq->symbols[s++] = symbols_of[i];
+		}
+	}
+}
+
+/************** Public  **************/
+packed_sequence *pack_sequence(const char *seq) {
+	int length = strlen(seq);
+	packed_sequence *packed = _packed_allocate(length);
+	int i;
+	for (i = 0; i < length; i++) {
+		int code = _base_code(seq[i]);
+		if (code < 0) {
+			if (packed->ambiguous == NULL) {
+				_allocate_ambiguous(packed);
+			}
+			packed->ambiguous[i >> 6] |= (uint64_t) 1 << (i & 63);
+			code = 0;
+		}
+		packed->bases[i >> 5] |= (uint64_t) code << ((i & 31) * 2);
+	}
+	
+	_finish_ambiguous(packed, seq);
+	return packed;
+}
+
+packed_sequence *reverse_packed_sequence(packed_sequence *seq) {
+	char *unpacked = unpack_sequence(seq);
+	int i, length = seq->length;
+	for (i = 0; i < length / 2; i++) {
+		char tmp = unpacked[i];
+		unpacked[i] = unpacked[length-1 - i];
+		unpacked[length-1 - i] = tmp;
+	}
+	
+	packed_sequence *reversed = pack_sequence(unpacked);
+	free(unpacked);
+	return reversed;
+}
+
+char packed_base(packed_sequence *seq, int i) {
+	if (_is_ambiguous(seq, i)) {
+		return _symbol(seq, i);
+	}
+	
+	return "ACGT"[(seq->bases[i >> 5] >> ((i & 31) * 2)) & 3];
+}
+
+char *unpack_sequence(packed_sequence *seq) {
+	char *unpacked = malloc(seq->length + 1);
+	int i;
+	for (i = 0; i < seq->length; i++) {
+		unpacked[i] = packed_base(seq, i);
+	}
+	unpacked[seq->length] = '\0';
+	
+	return unpacked;
+}
+
+void destroy_packed_sequence(packed_sequence *seq) {
+	free(seq->bases);
+	free(seq->ambiguous);
+	free(seq->ranks);
+	free(seq->symbols);
+	free(seq);
+}
+
+uint32_t packed_diagonal_matches(packed_sequence *a, int x, packed_sequence *b, int y, int count) {
+	uint32_t matches = _zero_pairs(_base_window(a, x) ^ _base_window(b, y));
+	if (a->ambiguous != NULL || b->ambiguous != NULL) {
+		uint32_t ambiguous_a = a->ambiguous != NULL ? _ambiguous_window(a, x) : 0;
+		uint32_t ambiguous_b = b->ambiguous != NULL ? _ambiguous_window(b, y) : 0;
+		uint32_t both = ambiguous_a & ambiguous_b;
+		matches &= ~(ambiguous_a | ambiguous_b);
+		while (both) { // ambiguous bases only match the same symbol
+			int t = __builtin_ctz(both);
+			both &= both - 1;
+			if (_symbol(a, x + t) == _symbol(b, y + t)) {
+				matches |= (uint32_t) 1 << t;
+			}
+		}
+	}
+	
+	return count < 32 ? matches & (((uint32_t) 1 << count) - 1) : matches;
+}
+
+void packed_match_row(packed_sequence *a, packed_sequence *b, int y, uint64_t *row) {
+	int words = (a->length + 63) / 64;
+	int w;
+	if (_is_ambiguous(b, y)) {
+		char symbol = _symbol(b, y);
+		memset(row, 0, words * sizeof(uint64_t));
+		if (a->ambiguous != NULL) {
+			for (w = 0; w < words; w++) {
+				uint64_t candidates = a->ambiguous[w];
+				while (candidates) {
+					int x = w * 64 + __builtin_ctzll(candidates);
+					candidates &= candidates - 1;
+					if (_symbol(a, x) == symbol) {
+						row[w] |= (uint64_t) 1 << (x & 63);
+					}
+				}
+			}
+		}
+		return;
+	}
+	
+	uint64_t pattern = (uint64_t) ((b->bases[y >> 5] >> ((y & 31) * 2)) & 3) * EVEN_BITS;
+	for (w = 0; w < words; w++) {
+		uint64_t lo = _zero_pairs(a->bases[2*w] ^ pattern);
+		uint64_t hi = _zero_pairs(a->bases[2*w + 1] ^ pattern);
+		row[w] = lo | (hi << 32);
+		if (a->ambiguous != NULL) {
+			row[w] &= ~a->ambiguous[w];
+		}
+	}
+	if (a->length & 63) { // padding decodes as A, so mask it off
+		row[words-1] &= ((uint64_t) 1 << (a->length & 63)) - 1;
+	}
+}
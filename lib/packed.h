@@ -0,0 +1,31 @@
+#ifndef DOTPLOT_PACKED_H
+#define DOTPLOT_PACKED_H
+
+#include <stdint.h>
+
+/*
+* A nucleotide sequence packed at 2 bits per base (32 bases per word, base i in bits
+* 2*(i%32)). Anything other than A, C, G or T is flagged in a side mask and kept as-is in
+* `symbols` so packed sequences compare exactly like the strings they came from
+*/
+typedef struct {
+	int length;
+	uint64_t *bases;
+	uint64_t *ambiguous; // one bit per base, NULL when every base is A, C, G or T
+	uint32_t *ranks;     // number of ambiguous bases before each word of the mask
+	char *symbols;       // the ambiguous bases, in order
+} packed_sequence;
+
+packed_sequence *pack_sequence(const char *seq);
+packed_sequence *reverse_packed_sequence(packed_sequence *seq);
+char *unpack_sequence(packed_sequence *seq); // returns a malloc'd string
+char packed_base(packed_sequence *seq, int i);
+void destroy_packed_sequence(packed_sequence *seq);
+
+/* Bit t is set when a[x+t] == b[y+t], for t < count <= 32 */
+uint32_t packed_diagonal_matches(packed_sequence *a, int x, packed_sequence *b, int y, int count);
+
+/* Fill one bit-packed dotplot row: bit x is set when a[x] == b[y] */
+void packed_match_row(packed_sequence *a, packed_sequence *b, int y, uint64_t *row);
+
+#endif
@@ -0,0 +1,94 @@
+#include "pngstream.h"
+#include <png.h>
+#include <setjmp.h>
+#include <stdlib.h>
+
+/*
+* libpng reports errors by longjmp-ing back to the last setjmp on its jump buffer, so every
+* call into it sets one up and turns an error into the failed flag
+*/
+
+/************** Public  **************/
+png_stream *open_png_stream(char *filename, int width, int height, const uint8_t *palette, int colors) {
+	if (colors < 1 || colors > 256) { // palette entries and pixels are one byte
+		return NULL;
+	}
+	
+	FILE *file = fopen(filename, "wb");
+	if (!file) {
+		return NULL;
+	}
+	
+	png_structp png = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+	png_infop info = png != NULL ? png_create_info_struct(png) : NULL;
+	if (info == NULL) {
+		png_destroy_write_struct(&png, NULL);
+		fclose(file);
+		return NULL;
+	}
+	
+	png_stream *stream = malloc(sizeof(png_stream));
+	stream->file = file;
+	stream->png = png;
+	stream->info = info;
+	stream->failed = 0;
+	if (setjmp(png_jmpbuf(png))) {
+		stream->failed = 1;
+		return stream;
+	}
+	
+	/* pack pixels as tightly as the palette allows, like gd does */
+	int depth = colors <= 2 ? 1 : colors <= 4 ? 2 : colors <= 16 ? 4 : 8;
+	png_color entries[256];
+	int i;
+	for (i = 0; i < colors; i++) {
+		entries[i].red = palette[3*i];
+		entries[i].green = palette[3*i+1];
+		entries[i].blue = palette[3*i+2];
+	}
+	
+	png_init_io(png, file);
+	png_set_IHDR(png, info, width, height, depth, PNG_COLOR_TYPE_PALETTE, PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+	png_set_PLTE(png, info, entries, colors);
+	png_write_info(png, info);
+	if (depth < 8) { // rows still come in as one byte per pixel
+		png_set_packing(png);
+	}
+	return stream;
+}
+
+int png_stream_row(png_stream *stream, uint8_t *row) {
+	if (stream->failed) {
+		return 0;
+	}
+	
+	png_structp png = stream->png;
+	if (setjmp(png_jmpbuf(png))) {
+		stream->failed = 1;
+		return 0;
+	}
+	png_write_row(png, row);
+	return 1;
+}
+
+int close_png_stream(png_stream *stream) {
+	png_structp png = stream->png;
+	png_infop info = stream->info;
+	if (!stream->failed) {
+		if (setjmp(png_jmpbuf(png))) {
+			stream->failed = 1;
+		}
+		else {
+			png_write_end(png, NULL);
+		}
+	}
+	
+	png_destroy_write_struct(&png, &info);
+	if (fclose(stream->file) != 0) {
+		stream->failed = 1;
+	}
+	
+	int ok = !stream->failed;
+	free(stream);
+	return ok;
+}
@@ -0,0 +1,23 @@
+#ifndef DOTPLOT_PNGSTREAM_H
+#define DOTPLOT_PNGSTREAM_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+* A palette PNG written one row at a time, so an image never has to be held in memory as a
+* whole. Rows hold one palette index per pixel and go out through libpng/zlib as they come
+*/
+typedef struct {
+	FILE *file;
+	void *png;  // png_structp
+	void *info; // png_infop
+	int failed; // set once libpng reports an error; later rows are dropped
+} png_stream;
+
+/* `palette` holds `colors` (1 to 256) RGB triples. Returns NULL for any other count or if the file can't be created */
+png_stream *open_png_stream(char *filename, int width, int height, const uint8_t *palette, int colors);
+int png_stream_row(png_stream *stream, uint8_t *row); // returns 0 once writing has failed
+int close_png_stream(png_stream *stream); // returns 1 if the whole image was written
+
+#endif
@@ -0,0 +1,57 @@
+#include "pool.h"
+#include <pthread.h>
+#include <stdlib.h>
+
+/*
+* A tiny worker pool for the O(n*m) loops of the dotplot. The calling thread takes part
+* in the work so a single thread never pays for pthread_create
+*/
+
+/************** Private **************/
+typedef struct {
+	void (*work)(void *arg, int task);
+	void *arg;
+	int tasks;
+	int next; // next task to hand out
+} pool_job;
+
+void *_pool_worker(void *data) {
+	pool_job *job = (pool_job*) data;
+	int task;
+	while ((task = __sync_fetch_and_add(&job->next, 1)) < job->tasks) {
+		job->work(job->arg, task);
+	}
+	
+	return NULL;
+}
+
+/************** Public  **************/
+void pool_run(int threads, int tasks, void (*work)(void *arg, int task), void *arg) {
+	pool_job job = {
+		.work = work,
+		.arg = arg,
+		.tasks = tasks,
+		.next = 0
+	};
+	if (threads > tasks) {
+		threads = tasks;
+	}
+	if (threads <= 1) {
+		_pool_worker(&job);
+		return;
+	}
+	
+	pthread_t workers[threads-1];
+	int started = 0;
+	int i;
+	for (i = 0; i < threads-1; i++) {
+		if (pthread_create(&workers[started], NULL, _pool_worker, &job) == 0) {
+			started++;
+		}
+	}
+	
+	_pool_worker(&job); // whatever could not be started is picked up here
+	for (i = 0; i < started; i++) {
+		pthread_join(workers[i], NULL);
+	}
+}
@@ -0,0 +1,11 @@
+#ifndef DOTPLOT_POOL_H
+#define DOTPLOT_POOL_H
+
+/*
+* Run `tasks` independent pieces of work over up to `threads` pthreads. Each call of
+* work(arg, task) gets a distinct task index in [0, tasks); tasks are handed out in order
+* so callers can keep per-task results and merge them deterministically afterwards
+*/
+void pool_run(int threads, int tasks, void (*work)(void *arg, int task), void *arg);
+
+#endif
@@ -0,0 +1,71 @@
+#include "run.h"
+#include <stdlib.h>
+
+/*
+* Helpers for engines that find runs out of order (seeded searches). find_alignments scans
+* all anti-diagonals and then all diagonals, each starting along the top row and then down
+* the side, and reports runs from the top of each diagonal down
+*/
+
+/************** Private **************/
+/*
+* A run with its place in scan order worked out up front, so the comparator needs no
+* width and concurrent sorts share no state
+*/
+typedef struct {
+	long long diagonal; // anti-diagonals first, then diagonals, each in scan order
+	int top;
+	run r;
+} keyed_run;
+
+/*
+* Index of the diagonal a run lies on, in scan order
+*/
+long long _diagonal_index(const run *r, int width) {
+	if (r->dir == UR) {
+		long long sum = (long long) r->x + r->y;
+		return sum < width ? width-1 - sum : sum;
+	}
+	
+	long long diff = (long long) r->x - r->y;
+	return diff >= 0 ? diff : width-1 - diff;
+}
+
+int _compare_keyed_runs(const void *a, const void *b) {
+	const keyed_run *ka = (const keyed_run*) a;
+	const keyed_run *kb = (const keyed_run*) b;
+	if (ka->r.dir != kb->r.dir) {
+		return ka->r.dir == UR ? -1 : 1; // anti-diagonals come first
+	}
+	if (ka->diagonal != kb->diagonal) {
+		return ka->diagonal < kb->diagonal ? -1 : 1;
+	}
+	
+	return (ka->top > kb->top) - (ka->top < kb->top);
+}
+
+/************** Public  **************/
+void sort_runs(run *runs, size_t count, int width) {
+	keyed_run *keyed = malloc((count > 0 ? count : 1) * sizeof(keyed_run));
+	size_t i;
+	for (i = 0; i < count; i++) {
+		keyed[i].diagonal = _diagonal_index(&runs[i], width);
+		keyed[i].top = runs[i].dir == UR ? runs[i].y - runs[i].length + 1 : runs[i].y; // top of the run
+		keyed[i].r = runs[i];
+	}
+	
+	qsort(keyed, count, sizeof(keyed_run), _compare_keyed_runs);
+	for (i = 0; i < count; i++) {
+		runs[i] = keyed[i].r;
+	}
+	free(keyed);
+}
+
+void push_run(run **runs, size_t *count, size_t *capacity, run r) {
+	if (*count == *capacity) {
+		*capacity = *capacity > 0 ? *capacity * 2 : 64;
+		*runs = realloc(*runs, *capacity * sizeof(run));
+	}
+	
+	(*runs)[(*count)++] = r;
+}
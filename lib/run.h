@@ -0,0 +1,28 @@
+#ifndef DOTPLOT_RUN_H
+#define DOTPLOT_RUN_H
+
+#include <stddef.h>
+
+/*
+* Internal description of an ungapped alignment shared by the alignment engines. A run
+* starts at its lowest x and covers (x + i, y + i) for LR runs or (x + i, y - i) for UR runs
+*/
+typedef enum {
+	UR, // upper right: x grows while y shrinks (anti-diagonal)
+	LR  // lower right: x and y grow together (diagonal)
+} direction;
+
+typedef struct {
+	int x;
+	int y;
+	int length;
+	direction dir;
+} run;
+
+/* Sort runs into the order find_alignments reports them for a dotplot of the given width */
+void sort_runs(run *runs, size_t count, int width);
+
+/* Append a run to a growable array */
+void push_run(run **runs, size_t *count, size_t *capacity, run r);
+
+#endif
@@ -0,0 +1,390 @@
+#include "suffix.h"
+#include "pool.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+* Suffix array engine for long reference sequences. The array is built in linear time
+* with SA-IS and costs 4 bytes per indexed base no matter how long the minimum alignment
+* is, unlike the k-mer table. Every seq2 position is looked up by binary search for its
+* next `length` bases; hits that start a run are extended into maximal exact matches
+*/
+
+/************** Private **************/
+#define INDEX_MAGIC "DPSI"
+#define INDEX_VERSION 1
+
+typedef struct {
+	suffix_index *index;
+	const char *seq2;
+	int height;
+	int length;
+	int tasks;
+	run **found;
+	size_t *counts;
+} suffix_job;
+
+#define IS_LMS(t, i) ((i) > 0 && (t)[i] && !(t)[(i)-1])
+
+/*
+* Set each bucket to its start (or one past its end) in the suffix array
+*/
+void _get_buckets(const int32_t *s, int n, int k, int32_t *buckets, int end) {
+	int i;
+	int32_t sum = 0;
+	memset(buckets, 0, (k + 1) * sizeof(int32_t));
+	for (i = 0; i < n; i++) {
+		buckets[s[i]]++;
+	}
+	for (i = 0; i <= k; i++) {
+		sum += buckets[i];
+		buckets[i] = end ? sum : sum - buckets[i];
+	}
+}
+
+void _induce_l(const int32_t *s, int32_t *sa, const unsigned char *t, int32_t *buckets, int n, int k) {
+	int i;
+	_get_buckets(s, n, k, buckets, 0);
+	for (i = 0; i < n; i++) {
+		int32_t j = sa[i] - 1;
+		if (sa[i] > 0 && !t[j]) {
+			sa[buckets[s[j]]++] = j;
+		}
+	}
+}
+
+void _induce_s(const int32_t *s, int32_t *sa, const unsigned char *t, int32_t *buckets, int n, int k) {
+	int i;
+	_get_buckets(s, n, k, buckets, 1);
+	for (i = n - 1; i >= 0; i--) {
+		int32_t j = sa[i] - 1;
+		if (sa[i] > 0 && t[j]) {
+			sa[--buckets[s[j]]] = j;
+		}
+	}
+}
+
+/*
+* SA-IS (Nong, Zhang and Chan). s[n-1] must be a unique smallest symbol and every symbol
+* must be in [0, k]
+*/
+void _sais(const int32_t *s, int32_t *sa, int n, int k) {
+	int i, j;
+	if (n < 2) {
+		if (n == 1) {
+			sa[0] = 0;
+		}
+		return;
+	}
+	
+	unsigned char *t = malloc(n); // 1 for S-type suffixes, 0 for L-type
+	int32_t *buckets = malloc((k + 1) * sizeof(int32_t));
+	t[n-1] = 1;
+	t[n-2] = 0;
+	for (i = n - 3; i >= 0; i--) {
+		t[i] = s[i] < s[i+1] || (s[i] == s[i+1] && t[i+1]);
+	}
+	
+	/* sort the LMS substrings */
+	_get_buckets(s, n, k, buckets, 1);
+	for (i = 0; i < n; i++) {
+		sa[i] = -1;
+	}
+	for (i = 1; i < n; i++) {
+		if (IS_LMS(t, i)) {
+			sa[--buckets[s[i]]] = i;
+		}
+	}
+	_induce_l(s, sa, t, buckets, n, k);
+	_induce_s(s, sa, t, buckets, n, k);
+	
+	/* name them */
+	int n1 = 0;
+	for (i = 0; i < n; i++) {
+		if (IS_LMS(t, sa[i])) {
+			sa[n1++] = sa[i];
+		}
+	}
+	for (i = n1; i < n; i++) {
+		sa[i] = -1;
+	}
+	int name = 0;
+	int32_t prev = -1;
+	for (i = 0; i < n1; i++) {
+		int32_t pos = sa[i];
+		int diff = 0;
+		int d;
+		for (d = 0; ; d++) {
+			if (prev == -1 || s[pos+d] != s[prev+d] || t[pos+d] != t[prev+d]) {
+				diff = 1;
+				break;
+			}
+			else if (d > 0 && (IS_LMS(t, pos+d) || IS_LMS(t, prev+d))) {
+				break;
+			}
+		}
+		if (diff) {
+			name++;
+			prev = pos;
+		}
+		sa[n1 + pos / 2] = name - 1;
+	}
+	for (i = n - 1, j = n - 1; i >= n1; i--) {
+		if (sa[i] >= 0) {
+			sa[j--] = sa[i];
+		}
+	}
+	
+	/* sort the reduced string, recursing while names are not unique */
+	int32_t *s1 = sa + n - n1;
+	int32_t *sa1 = sa;
+	if (name < n1) {
+		_sais(s1, sa1, n1, name - 1);
+	}
+	else {
+		for (i = 0; i < n1; i++) {
+			sa1[s1[i]] = i;
+		}
+	}
+	
+	/* induce the full suffix array from the sorted LMS suffixes */
+	_get_buckets(s, n, k, buckets, 1);
+	for (i = 1, j = 0; i < n; i++) {
+		if (IS_LMS(t, i)) {
+			s1[j++] = i;
+		}
+	}
+	for (i = 0; i < n1; i++) {
+		sa1[i] = s1[sa1[i]];
+	}
+	for (i = n1; i < n; i++) {
+		sa[i] = -1;
+	}
+	for (i = n1 - 1; i >= 0; i--) {
+		j = sa[i];
+		sa[i] = -1;
+		sa[--buckets[s[j]]] = j;
+	}
+	_induce_l(s, sa, t, buckets, n, k);
+	_induce_s(s, sa, t, buckets, n, k);
+	
+	free(buckets);
+	free(t);
+}
+
+/*
+* First suffix (in [lo, hi)) whose first `length` characters compare >= pattern, or > pattern
+* when `after` is set
+*/
+int _search(suffix_index *index, const char *pattern, int length, int lo, int hi, int after) {
+	while (lo < hi) {
+		int mid = lo + (hi - lo) / 2;
+		int cmp = strncmp(index->text + index->suffixes[mid], pattern, length);
+		if (cmp < 0 || (after && cmp == 0)) {
+			lo = mid + 1;
+		}
+		else {
+			hi = mid;
+		}
+	}
+	
+	return lo;
+}
+
+void _suffix_band(void *arg, int task) {
+	suffix_job *job = (suffix_job*) arg;
+	suffix_index *index = job->index;
+	const char *seq1 = index->text;
+	const char *seq2 = job->seq2;
+	int width = index->width;
+	int length = job->length;
+	int patterns = job->height - length + 1;
+	int start = (int) ((long long) patterns * task / job->tasks);
+	int end = (int) ((long long) patterns * (task + 1) / job->tasks);
+	run *found = NULL;
+	size_t count = 0, capacity = 0;
+	int j;
+	
+	for (j = start; j < end; j++) {
+		int lo = _search(index, seq2 + j, length, 0, index->length, 0);
+		int hi = _search(index, seq2 + j, length, lo, index->length, 1);
+		int h;
+		for (h = lo; h < hi; h++) {
+			int p = index->suffixes[h];
+			if (p == width || (p < width && p + length > width)) {
+				continue; // matched the separator, which seq2 can hold too
+			}
+			if (p < width) { // diagonal hit at (p, j)
+				int i = p;
+				if (i > 0 && j > 0 && seq1[i-1] == seq2[j-1]) {
+					continue; // inside a run found from its first cell
+				}
+				
+				int stretch = length;
+				while (i + stretch < width && j + stretch < job->height && seq1[i+stretch] == seq2[j+stretch]) {
+					stretch++;
+				}
+				run r = {i, j, stretch, LR};
+				push_run(&found, &count, &capacity, r);
+			}
+			else { // hit in the reversed copy: anti-diagonal from (i, j) towards lower x
+				int i = width - 1 - (p - width - 1);
+				if (i + 1 < width && j > 0 && seq1[i+1] == seq2[j-1]) {
+					continue;
+				}
+				
+				int stretch = length;
+				while (i - stretch >= 0 && j + stretch < job->height && seq1[i-stretch] == seq2[j+stretch]) {
+					stretch++;
+				}
+				run r = {i - stretch + 1, j + stretch - 1, stretch, UR};
+				push_run(&found, &count, &capacity, r);
+			}
+		}
+	}
+	
+	job->found[task] = found;
+	job->counts[task] = count;
+}
+
+/************** Public  **************/
+suffix_index *create_suffix_index(char *seq1) {
+	int width = strlen(seq1);
+	int n = 2 * width + 2;
+	int i;
+	
+	suffix_index *index = malloc(sizeof *index);
+	index->width = width;
+	index->length = n;
+	index->text = malloc(n);
+	index->suffixes = malloc(n * sizeof(int32_t));
+	memcpy(index->text, seq1, width);
+	index->text[width] = '\x01'; // sorts before any base
+	for (i = 0; i < width; i++) {
+		index->text[width + 1 + i] = seq1[width - 1 - i];
+	}
+	index->text[n-1] = '\0';
+	
+	int32_t *s = malloc(n * sizeof(int32_t));
+	for (i = 0; i < n; i++) {
+		s[i] = (unsigned char) index->text[i];
+	}
+	_sais(s, index->suffixes, n, 255);
+	free(s);
+	
+	return index;
+}
+
+void destroy_suffix_index(suffix_index *index) {
+	free(index->text);
+	free(index->suffixes);
+	free(index);
+}
+
+/*
+* Index files hold a magic number, a version, the sequence length, the text and the suffix
+* array in native byte order
+*/
+int write_suffix_index(suffix_index *index, char *filename) {
+	FILE *out = fopen(filename, "wb");
+	if (!out) {
+		return 0;
+	}
+	
+	int32_t header[2] = {INDEX_VERSION, index->width};
+	int ok = fwrite(INDEX_MAGIC, 1, 4, out) == 4
+		&& fwrite(header, sizeof(int32_t), 2, out) == 2
+		&& fwrite(index->text, 1, index->length, out) == (size_t) index->length
+		&& fwrite(index->suffixes, sizeof(int32_t), index->length, out) == (size_t) index->length;
+	if (fclose(out) != 0) {
+		ok = 0;
+	}
+	
+	return ok;
+}
+
+suffix_index *read_suffix_index(char *filename) {
+	FILE *in = fopen(filename, "rb");
+	if (!in) {
+		return NULL;
+	}
+	
+	char magic[4];
+	int32_t header[2];
+	if (fread(magic, 1, 4, in) != 4 || memcmp(magic, INDEX_MAGIC, 4) != 0
+		|| fread(header, sizeof(int32_t), 2, in) != 2 || header[0] != INDEX_VERSION || header[1] < 0 || header[1] > (INT32_MAX - 2) / 2) {
+		fclose(in);
+		return NULL;
+	}
+	
+	suffix_index *index = malloc(sizeof *index);
+	index->width = header[1];
+	index->length = 2 * index->width + 2;
+	index->text = malloc(index->length);
+	index->suffixes = malloc(index->length * sizeof(int32_t));
+	if (fread(index->text, 1, index->length, in) != (size_t) index->length
+		|| fread(index->suffixes, sizeof(int32_t), index->length, in) != (size_t) index->length) {
+		fclose(in);
+		destroy_suffix_index(index);
+		return NULL;
+	}
+	fclose(in);
+	
+	/* Searches trust the layout and every entry, so a damaged file is turned away here */
+	int valid = index->text[index->width] == '\x01' && index->text[index->length-1] == '\0';
+	int i;
+	for (i = 0; i < index->length && valid; i++) {
+		valid = index->suffixes[i] >= 0 && index->suffixes[i] < index->length;
+	}
+	if (!valid) {
+		destroy_suffix_index(index);
+		return NULL;
+	}
+	
+	return index;
+}
+
+run *suffix_find_runs(suffix_index *index, const char *seq2, int height, int length, int threads, size_t *count) {
+	*count = 0;
+	if (length < 1) {
+		length = 1;
+	}
+	int patterns = height - length + 1;
+	if (patterns <= 0 || index->width < length) {
+		return malloc(sizeof(run)); // nothing long enough to match
+	}
+	
+	suffix_job job = {
+		.index = index,
+		.seq2 = seq2,
+		.height = height,
+		.length = length,
+		.tasks = threads * 8 < patterns ? threads * 8 : patterns
+	};
+	if (job.tasks < 1) {
+		job.tasks = 1;
+	}
+	run *found[job.tasks];
+	size_t counts[job.tasks];
+	job.found = found;
+	job.counts = counts;
+	pool_run(threads, job.tasks, _suffix_band, &job);
+	
+	size_t total = 0;
+	int i;
+	for (i = 0; i < job.tasks; i++) {
+		total += counts[i];
+	}
+	run *runs = malloc((total > 0 ? total : 1) * sizeof(run));
+	for (i = 0; i < job.tasks; i++) {
+		if (counts[i] > 0) {
+			memcpy(runs + *count, found[i], counts[i] * sizeof(run));
+			*count += counts[i];
+		}
+		free(found[i]);
+	}
+	
+	sort_runs(runs, *count, index->width);
+	return runs;
+}
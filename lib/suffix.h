@@ -0,0 +1,27 @@
+#ifndef DOTPLOT_SUFFIX_H
+#define DOTPLOT_SUFFIX_H
+
+#include <stdint.h>
+#include "run.h"
+
+/*
+* A suffix array over the first sequence of a comparison (the reference). The text holds
+* the sequence, a separator and the sequence reversed so that one index answers both
+* diagonal and anti-diagonal queries
+*/
+typedef struct {
+	int width;          // length of the indexed sequence
+	int length;         // length of text, including the separator and the terminating NUL
+	char *text;
+	int32_t *suffixes;  // suffix array over text
+} suffix_index;
+
+suffix_index *create_suffix_index(char *seq1);
+void destroy_suffix_index(suffix_index *index);
+int write_suffix_index(suffix_index *index, char *filename); // returns 1 on success
+suffix_index *read_suffix_index(char *filename); // returns NULL if the file is not a suffix index
+
+/* Find every run of at least `length` matches, in find_alignments order */
+run *suffix_find_runs(suffix_index *index, const char *seq2, int height, int length, int threads, size_t *count);
+
+#endif
@@ -0,0 +1,304 @@
+#include "values.h"
+#include "gzip.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+* Value files run to millions of lines, so they are mapped instead of read line by line.
+* Lines are counted first to size the result, then parsed in place. Plain decimals (the
+* whole of a conservation track in practice) go through a locale-free fast path that is
+* exact whenever the digits fit in a double; anything else is handed to strtod. gzip and
+* bgzip files are inflated into memory and parsed from there
+*/
+#ifdef __unix__
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define CACHE_MAGIC "DPVF"
+#define CACHE_VERSION 1
+#define CACHE_SUFFIX ".f32"
+
+typedef struct {
+	char magic[4];
+	uint32_t version;
+	uint64_t count;
+	int64_t source_size; // the text file the cache was made from
+	int64_t source_mtime;
+	int64_t source_mtime_nsec;
+} cache_header;
+
+static const double powers_of_ten[] = {
+	1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+	1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+/************** Private **************/
+static inline int _is_blank(char c) {
+	return c == ' ' || c == '\t' || c == '\r';
+}
+
+/*
+* Parse a decimal with at most 19 significant digits and a small exponent. The mantissa
+* and the power of ten are both exact doubles, so one multiplication or division rounds
+* correctly. Returns 0 if the text needs the slow path
+*/
+int _parse_fast(const char *p, const char *end, float *value) {
+	uint64_t mantissa = 0;
+	int exponent = 0, digits = 0, seen = 0, negative = 0;
+	if (p < end && (*p == '-' || *p == '+')) {
+		negative = *p++ == '-';
+	}
+	for (; p < end && *p >= '0' && *p <= '9'; p++, seen = 1) {
+		if (mantissa != 0 || *p != '0') {
+			if (++digits > 19) {
+				return 0;
+			}
+			mantissa = mantissa * 10 + (*p - '0');
+		}
+	}
+	if (p < end && *p == '.') {
+		for (p++; p < end && *p >= '0' && *p <= '9'; p++, seen = 1) {
+			if (mantissa != 0 || *p != '0') {
+				if (++digits > 19) {
+					return 0;
+				}
+				mantissa = mantissa * 10 + (*p - '0');
+			}
+			exponent--;
+		}
+	}
+	if (!seen) {
+		return 0;
+	}
+	if (p < end && (*p == 'e' || *p == 'E')) {
+		int sign = 1, e = 0;
+		p++;
+		if (p < end && (*p == '-' || *p == '+')) {
+			sign = *p++ == '-' ? -1 : 1;
+		}
+		if (p == end || *p < '0' || *p > '9') {
+			return 0;
+		}
+		for (; p < end && *p >= '0' && *p <= '9'; p++) {
+			if (e < 10000) {
+				e = e * 10 + (*p - '0');
+			}
+		}
+		exponent += sign * e;
+	}
+	if (p != end || mantissa > ((uint64_t) 1 << 53) || exponent < -22 || exponent > 22) {
+		return 0;
+	}
+	
+	double result = (double) mantissa;
+	result = exponent < 0 ? result / powers_of_ten[-exponent] : result * powers_of_ten[exponent];
+	*value = negative ? -result : result;
+	return 1;
+}
+
+/*
+* Parse the text between two blanks-trimmed bounds as one float
+*/
+int _parse_value(const char *p, const char *end, float *value) {
+	if (_parse_fast(p, end, value)) {
+		return 1;
+	}
+	
+	char text[64];
+	size_t length = end - p;
+	if (length == 0 || length >= sizeof(text)) {
+		return 0;
+	}
+	memcpy(text, p, length);
+	text[length] = '\0';
+	
+	char *parsed;
+	double result = strtod(text, &parsed);
+	if (parsed != text + length) {
+		return 0;
+	}
+	*value = result;
+	return 1;
+}
+
+void _value_error(value_error *error, char *filename, int line) {
+	if (error != NULL) {
+		error->file = filename;
+		error->line = line;
+	}
+}
+
+/*
+* Parse mapped text. Trailing blank lines are ignored; any other line must hold exactly
+* one number
+*/
+float *_parse_values(char *filename, const char *text, size_t size, int *count, value_error *error) {
+	const char *end = text + size;
+	while (end > text && (_is_blank(end[-1]) || end[-1] == '\n')) {
+		end--;
+	}
+	
+	size_t lines = 0;
+	const char *p = text;
+	while (p < end) {
+		const char *newline = memchr(p, '\n', end - p);
+		lines++;
+		p = newline != NULL ? newline + 1 : end;
+	}
+	
+	float *values = malloc((lines > 0 ? lines : 1) * sizeof(float));
+	size_t i;
+	p = text;
+	for (i = 0; i < lines; i++) {
+		const char *newline = memchr(p, '\n', end - p);
+		const char *line_end = newline != NULL ? newline : end;
+		const char *q = line_end;
+		while (p < q && _is_blank(*p)) {
+			p++;
+		}
+		while (q > p && _is_blank(q[-1])) {
+			q--;
+		}
+		if (!_parse_value(p, q, &values[i])) {
+			free(values);
+			_value_error(error, filename, i + 1);
+			return NULL;
+		}
+		p = line_end + 1;
+	}
+	
+	*count = lines;
+	return values;
+}
+
+char *_cache_name(char *filename) {
+	char *name = malloc(strlen(filename) + sizeof(CACHE_SUFFIX));
+	strcpy(name, filename);
+	strcat(name, CACHE_SUFFIX);
+	return name;
+}
+
+float *_read_cache(char *filename, struct stat *source, int *count) {
+	char *name = _cache_name(filename);
+	FILE *in = fopen(name, "rb");
+	free(name);
+	if (!in) {
+		return NULL;
+	}
+	
+	cache_header header;
+	if (fread(&header, sizeof(header), 1, in) != 1 || memcmp(header.magic, CACHE_MAGIC, 4) != 0
+		|| header.version != CACHE_VERSION || header.source_size != (int64_t) source->st_size
+		|| header.source_mtime != (int64_t) source->st_mtim.tv_sec
+		|| header.source_mtime_nsec != (int64_t) source->st_mtim.tv_nsec || header.count > INT32_MAX) {
+		fclose(in);
+		return NULL; // stale or not a cache
+	}
+	
+	float *values = malloc((header.count > 0 ? header.count : 1) * sizeof(float));
+	if (fread(values, sizeof(float), header.count, in) != header.count) {
+		free(values);
+		fclose(in);
+		return NULL;
+	}
+	
+	fclose(in);
+	*count = header.count;
+	return values;
+}
+
+/*
+* Save the cache under a temporary name first so readers never see half a file. Failing
+* to write it is not an error
+*/
+void _write_cache(char *filename, struct stat *source, float *values, int count) {
+	char *name = _cache_name(filename);
+	char *temporary = malloc(strlen(name) + 5);
+	strcpy(temporary, name);
+	strcat(temporary, ".tmp");
+	
+	cache_header header = {
+		.version = CACHE_VERSION,
+		.count = count,
+		.source_size = source->st_size,
+		.source_mtime = source->st_mtim.tv_sec,
+		.source_mtime_nsec = source->st_mtim.tv_nsec
+	};
+	memcpy(header.magic, CACHE_MAGIC, 4);
+	
+	FILE *out = fopen(temporary, "wb");
+	if (out) {
+		int ok = fwrite(&header, sizeof(header), 1, out) == 1
+			&& fwrite(values, sizeof(float), count, out) == (size_t) count;
+		if (fclose(out) != 0 || !ok || rename(temporary, name) != 0) {
+			unlink(temporary);
+		}
+	}
+	
+	free(temporary);
+	free(name);
+}
+
+float *_read_values(char *filename, int *count, value_error *error, int cached) {
+	int fd = open(filename, O_RDONLY);
+	struct stat st;
+	if (fd < 0 || fstat(fd, &st) != 0) {
+		if (fd >= 0) {
+			close(fd);
+		}
+		_value_error(error, filename, 0);
+		return NULL;
+	}
+	
+	float *values;
+	if (cached && (values = _read_cache(filename, &st, count)) != NULL) {
+		close(fd);
+		return values;
+	}
+	
+	if (st.st_size == 0) {
+		values = _parse_values(filename, "", 0, count, error);
+	}
+	else {
+		void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (map == MAP_FAILED) {
+			close(fd);
+			_value_error(error, filename, 0);
+			return NULL;
+		}
+		madvise(map, st.st_size, MADV_SEQUENTIAL);
+		if (is_gzip(map, st.st_size)) {
+			size_t size;
+			char *text = inflate_gzip(map, st.st_size, &size);
+			values = text != NULL ? _parse_values(filename, text, size, count, error) : NULL;
+			if (text == NULL) {
+				_value_error(error, filename, 0);
+			}
+			free(text);
+		}
+		else {
+			values = _parse_values(filename, map, st.st_size, count, error);
+		}
+		munmap(map, st.st_size);
+	}
+	close(fd);
+	
+	if (cached && values != NULL) {
+		_write_cache(filename, &st, values, *count);
+	}
+	return values;
+}
+
+/************** Public  **************/
+float *read_values(char *filename, int *count, value_error *error) {
+	return _read_values(filename, count, error, 0);
+}
+
+float *read_values_cached(char *filename, int *count, value_error *error) {
+	return _read_values(filename, count, error, 1);
+}
+#endif
@@ -0,0 +1,19 @@
+#ifndef DOTPLOT_VALUES_H
+#define DOTPLOT_VALUES_H
+
+/*
+* Loading of value files (one decimal number per line, as used for score filters)
+*/
+typedef struct {
+	char *file; // the file that failed to load
+	int line;   // first malformed line, counting from 1, or 0 if the file couldn't be read
+} value_error;
+
+#ifdef __unix__
+	/* Returns NULL on failure, filling in `error` if it isn't NULL */
+	float *read_values(char *filename, int *count, value_error *error);
+	/* Same as read_values, going through a float32 cache saved as <filename>.f32 */
+	float *read_values_cached(char *filename, int *count, value_error *error);
+#endif
+
+#endif